@@ -9,6 +9,34 @@
 #include <fstream>
 #include <sstream>
 #include <cassert>
+#include <stdexcept>
+#include <unordered_map>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dlfcn.h>
+#include <zlib.h>
 
 using StringMap = std::map<std::string, std::string>;
 using StringSet = std::set<std::string>;
@@ -20,23 +48,50 @@ enum FieldValueLimit {
   FVL_QUOTE
 };
 
+/* what a year, month, pages, number or day value means,
+   filled in by type_fields once the text is normalized */
+enum FieldType {
+  FT_UNPARSED,
+  FT_TEXT,
+  FT_NUMBER,
+  FT_RANGE,
+  FT_MONTH
+};
+
 struct Field {
-  Field():limit(FVL_CURLY) {}
+  Field():limit(FVL_CURLY),type(FT_UNPARSED),first(0),last(0) {}
   std::string name;
   std::string value;
   FieldValueLimit limit;
+  /* first and last page, day or number of a range,
+     the same number twice otherwise, 1 to 12 for months */
+  FieldType type;
+  int first;
+  int last;
 };
 
 using Fields = std::vector<Field>;
+using AuthorIds = std::vector<uint32_t>;
 
 struct Entry {
+  Entry():source_begin(0),source_end(0),modified(false) {}
   std::string type;
   std::string key;
   Fields fields;
   std::string comment;
+  /* byte span of the entry in the parsed file,
+     empty for entries created by a pass */
+  size_t source_begin;
+  size_t source_end;
+  /* set by any pass that changes the entry */
+  bool modified;
+  /* the author field as ids in get_author_table(),
+     filled by fix_author_lists */
+  AuthorIds authors;
 };
 
 using Entries = std::vector<Entry>;
+using KeyIndex = std::unordered_map<std::string, size_t>;
 
 static Fields::const_iterator find_field(Entry const& entry, std::string const& field_name) {
   return std::find_if(begin(entry.fields), end(entry.fields),
@@ -53,6 +108,17 @@ static Entries::const_iterator find_entry(Entries const& entries, std::string co
       [&](Entry const& entry)->bool { return entry.key == key; });
 }
 
+static bool has_source(Entry const& entry) {
+  return entry.source_end > entry.source_begin;
+}
+
+static void set_value(Entry& entry, Field& field, std::string const& value) {
+  if (field.value == value) return;
+  field.value = value;
+  field.type = FT_UNPARSED;
+  entry.modified = true;
+}
+
 static bool has_field(Entry const& entry, std::string const& field_name) {
   return entry.fields.end() != find_field(entry, field_name);
 }
@@ -69,6 +135,17 @@ static Entry const& get_entry(Entries const& entries, std::string const& key) {
   return *(find_entry(entries, key));
 }
 
+/* maps each key to the position of its first entry,
+   for callers doing many lookups on the same entries */
+static KeyIndex build_key_index(Entries const& entries) {
+  KeyIndex index;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].key.empty()) continue;
+    index.insert(std::make_pair(entries[i].key, i));
+  }
+  return index;
+}
+
 enum ParserState {
   LIMBO,
   ENTRY_TYPE,
@@ -93,15 +170,146 @@ static std::string as_lowercase(std::string const& s) {
 
 static void print_entries(std::ostream& stream, Entries const& entries);
 
+struct ParseError : public std::runtime_error {
+  ParseError(std::string const& what):std::runtime_error(what) {}
+};
+
+/* what happens to values that use @string macros:
+   kept as written, with the definitions normalized once
+   by the passes, or replaced by the text they stand for */
+enum StringMacros {
+  STRINGS_KEEP,
+  STRINGS_EXPAND
+};
+
+static bool parse_string_macros(std::string const& name, StringMacros& strings) {
+  if (name == "keep") strings = STRINGS_KEEP;
+  else if (name == "expand") strings = STRINGS_EXPAND;
+  else return false;
+  return true;
+}
+
+/* the text of each @string macro seen so far, expanded when it
+   is defined as BibTeX does, so that every use is a lookup and
+   later redefinitions do not change macros built from it.
+   months are left to the style, so macros and values that use
+   them are never expanded. */
+class MacroTable {
+  std::unordered_map<std::string, std::string> expanded;
+
+  /* a value written without braces or quotes, such as
+     ijnme  or  mar # " 20, 2017" : quoted or braced text,
+     numbers and macro names joined by # .
+     false if expr is not such an expression */
+  bool expand_expression(std::string const& expr, std::string& text,
+      std::string& rest, StringVector& undefined) {
+    text.clear();
+    rest.clear();
+    undefined.clear();
+    /* the text so far goes into rest as written when it was a
+       single string or number, otherwise as a braced string */
+    size_t pieces = 0;
+    std::string piece;
+    auto flush = [&]() {
+      if (!pieces) return;
+      if (!rest.empty()) rest += " # ";
+      rest += pieces == 1 && !piece.empty() ? piece : "{" + text + "}";
+      text.clear();
+      pieces = 0;
+    };
+    size_t i = 0;
+    while (true) {
+      while (i < expr.size() && expr[i] == ' ') ++i;
+      if (i == expr.size()) return false;
+      size_t start = i;
+      ++pieces;
+      if (expr[i] == '"' || expr[i] == '{') {
+        char close = expr[i] == '"' ? '"' : '}';
+        int depth = 0;
+        size_t b = ++i;
+        for (; i < expr.size(); ++i) {
+          if (expr[i] == close && depth == 0) break;
+          if (expr[i] == '{') ++depth;
+          if (expr[i] == '}') --depth;
+        }
+        if (i == expr.size()) return false;
+        text.append(expr, b, i - b);
+        ++i;
+        piece = expr.substr(start, i - start);
+      } else {
+        size_t b = i;
+        while (i < expr.size() && expr[i] != ' ' && expr[i] != '#') ++i;
+        auto word = expr.substr(b, i - b);
+        if (std::all_of(word.begin(), word.end(), ::isdigit)) {
+          text += word;
+          piece = word;
+        } else {
+          auto it = expanded.find(as_lowercase(word));
+          if (it != expanded.end()) {
+            text += it->second;
+            piece.clear();
+          } else {
+            --pieces;
+            flush();
+            if (!rest.empty()) rest += " # ";
+            rest += word;
+            undefined.push_back(word);
+          }
+        }
+      }
+      while (i < expr.size() && expr[i] == ' ') ++i;
+      if (i == expr.size()) break;
+      if (expr[i] != '#') return false;
+      ++i;
+    }
+    if (!undefined.empty()) flush();
+    return true;
+  }
+
+public:
+
+  void define(std::string const& name, Field const& value) {
+    auto key = as_lowercase(name);
+    std::string text;
+    if (expand(value, text)) expanded[key] = text;
+    else expanded.erase(key);
+  }
+
+  /* the text value stands for, false if it uses a macro
+     that is not defined or could not be expanded */
+  bool expand(Field const& value, std::string& text) {
+    std::string rest;
+    StringVector undefined;
+    return expand(value, text, rest, undefined) && undefined.empty();
+  }
+
+  /* as above, but when some macros are undefined, rest is value
+     with everything else folded into braced text and undefined
+     lists those macros. false only if value is malformed. */
+  bool expand(Field const& value, std::string& text,
+      std::string& rest, StringVector& undefined) {
+    if (value.limit != FVL_NONE) {
+      text = value.value;
+      rest.clear();
+      undefined.clear();
+      return true;
+    }
+    return expand_expression(value.value, text, rest, undefined);
+  }
+};
+
 static bool isident(char c) {
   return std::isalnum(c) || c == '-' || c == '_' ||
     c == '.' || c == ':' || c == '/';
 }
 
 class Parser {
+  StringMacros strings;
+  MacroTable macros;
   ParserState state;
   int line;
   int column;
+  size_t offset;
   int curly_depth;
   bool in_quote;
   Entries entries;
@@ -129,141 +337,220 @@ class Parser {
 
   void fail() __attribute__((noreturn));
 
+  /* a '}' right after a bare value, as in  month=nov},
+     closes the entry as well */
+  void value_ended() {
+    if (value_limit() == FVL_NONE && c == '}') end_entry();
+    else state = FIELD_LIMBO;
+  }
+
+  void end_entry() {
+    entries.back().source_end = offset + 1;
+    finish_entry();
+    state = LIMBO;
+  }
+
+  /* defines @string macros as they are read, and
+     with STRINGS_EXPAND replaces the other entries'
+     uses of them, dropping the definitions */
+  void finish_entry() {
+    auto& entry = entries.back();
+    if (entry.type == "string") {
+      if (!entry.fields.empty()) macros.define(entry.fields.back().name, entry.fields.back());
+      if (strings == STRINGS_EXPAND) entries.pop_back();
+      return;
+    }
+    if (strings != STRINGS_EXPAND) return;
+    std::string text;
+    std::string rest;
+    StringVector undefined;
+    for (auto& field : entry.fields) {
+      if (field.limit != FVL_NONE) continue;
+      if (std::all_of(field.value.begin(), field.value.end(), ::isdigit)) continue;
+      if (!macros.expand(field, text, rest, undefined)) continue;
+      /* the definitions are dropped, so only the undefined
+         macros may stay behind for warn_undefined_macros */
+      if (undefined.empty()) {
+        field.value = text;
+        field.limit = FVL_CURLY;
+      } else if (rest != field.value) {
+        field.value = rest;
+      } else {
+        continue;
+      }
+      entry.modified = true;
+    }
+  }
+
   bool field_value_ended() {
     if (curly_depth != 0) return false;
     switch (value_limit()) {
-      case FVL_NONE: return (!in_quote && c == ',') || c == '\n';
+      case FVL_NONE: return (!in_quote && (c == ',' || c == '}')) || c == '\n';
       case FVL_CURLY: return c == '}';
       case FVL_QUOTE: return c == '"';
     }
   }
 
+  void step() {
+    ++column;
+    switch (state) {
+      case LIMBO:
+        if (std::isspace(c)) break;
+        else if (c == '@') {
+          state = ENTRY_TYPE;
+          entries.push_back(Entry());
+          entries.back().source_begin = offset;
+        } else {
+          entries.push_back(Entry());
+          entries.back().source_begin = offset;
+          entries.back().type = "comment";
+          entries.back().comment.push_back(c);
+          state = COMMENT;
+        }
+      break;
+      case ENTRY_TYPE:
+        if (std::isspace(c)) {
+          if (as_lowercase(entries.back().type) == "comment") {
+            make_lowercase(entries.back().type);
+            state = COMMENT;
+          } else break;
+        }
+        else if (c == '{') {
+          make_lowercase(entries.back().type);
+          if (entries.back().type == "string") state = FIELD_LIMBO;
+          else if (entries.back().type == "preamble") {
+            entries.back().fields.push_back(Field());
+            entries.back().fields.back().name = "preamble";
+            state = FIELD_POST_EQUAL;
+          } else state = ENTRY_KEY;
+        }
+        else if (std::isalpha(c)) {
+          entries.back().type.push_back(c);
+        }
+        else fail();
+      break;
+      case ENTRY_KEY:
+        if (std::isspace(c)) break;
+        else if (c == ',') {
+          state = FIELD_LIMBO;
+        } else if (isident(c)) {
+          entries.back().key.push_back(c);
+        } else fail();
+      break;
+      case FIELD_LIMBO:
+        if (std::isspace(c)) break;
+        else if (std::isalpha(c)) {
+          entries.back().fields.push_back(Field());
+          entries.back().fields.back().name.push_back(c);
+          state = FIELD_NAME;
+        } else if (c == '}') {
+          end_entry();
+        }
+        else if (c == ',') break;
+        else fail();
+      break;
+      case FIELD_NAME:
+        if (std::isspace(c)) break;
+        else if (isident(c)) {
+          entries.back().fields.back().name.push_back(c);
+        } else if (c == '=') {
+          make_lowercase(entries.back().fields.back().name);
+          state = FIELD_POST_EQUAL;
+        } else fail();
+      break;
+      case FIELD_POST_EQUAL:
+        if (std::isspace(c)) break;
+        else if (c == '{') {
+          state = FIELD_VALUE_TEXT;
+          value_limit() = FVL_CURLY;
+        } else if (c == '"') {
+          state = FIELD_VALUE_TEXT;
+          value_limit() = FVL_QUOTE;
+        } else if (std::isprint(c)) {
+          value_limit() = FVL_NONE;
+          handle_curly();
+          handle_quote();
+          entries.back().fields.back().value.push_back(c);
+          state = FIELD_VALUE_TEXT;
+        } else fail();
+      break;
+      case FIELD_VALUE_TEXT:
+        if (field_value_ended()) {
+          value_ended();
+        } else if (std::isspace(c)) {
+          state = FIELD_VALUE_SPACE;
+        } else if (std::isprint(c)) {
+          handle_curly();
+          handle_quote();
+          entries.back().fields.back().value.push_back(c);
+        } else fail();
+      break;
+      case FIELD_VALUE_SPACE:
+        if (field_value_ended()) {
+          /* "Proc. of the " # venue needs its space */
+          if (entries.back().type == "string" && value_limit() != FVL_NONE)
+            entries.back().fields.back().value.push_back(' ');
+          value_ended();
+        } else if (std::isspace(c)) {
+          break;
+        } else if (std::isprint(c)) {
+          handle_curly();
+          handle_quote();
+          entries.back().fields.back().value.push_back(' ');
+          entries.back().fields.back().value.push_back(c);
+          state = FIELD_VALUE_TEXT;
+        } else fail();
+      break;
+      case COMMENT:
+        if (c == '\n') {
+          entries.back().source_end = offset;
+          state = LIMBO;
+        } else entries.back().comment.push_back(c);
+      break;
+    }
+    if (c == '\n') {
+      ++line;
+      column = 0;
+    }
+  }
+
 public:
 
-  void run(std::istream& stream) {
+  Parser(StringMacros s = STRINGS_KEEP):strings(s) {}
+
+  void start() {
     in_quote = false;
     entries.clear();
     state = LIMBO;
     line = 1;
     column = 0;
+    offset = 0;
     curly_depth = 0;
-    while (stream.get(c)) {
-      ++column;
-      switch (state) {
-        case LIMBO:
-          if (std::isspace(c)) break;
-          else if (c == '@') {
-            state = ENTRY_TYPE;
-            entries.push_back(Entry());
-          } else {
-            entries.push_back(Entry());
-            entries.back().type = "comment";
-            entries.back().comment.push_back(c);
-            state = COMMENT;
-          }
-        break;
-        case ENTRY_TYPE:
-          if (std::isspace(c)) {
-            if (as_lowercase(entries.back().type) == "comment") {
-              make_lowercase(entries.back().type);
-              state = COMMENT;
-            } else break;
-          }
-          else if (c == '{') {
-            make_lowercase(entries.back().type);
-            if (entries.back().type == "string") state = FIELD_LIMBO;
-            else if (entries.back().type == "preamble") {
-              entries.back().fields.push_back(Field());
-              entries.back().fields.back().name = "preamble";
-              state = FIELD_POST_EQUAL;
-            } else state = ENTRY_KEY;
-          }
-          else if (std::isalpha(c)) {
-            entries.back().type.push_back(c);
-          }
-          else fail();
-        break;
-        case ENTRY_KEY:
-          if (std::isspace(c)) break;
-          else if (c == ',') {
-            state = FIELD_LIMBO;
-          } else if (isident(c)) {
-            entries.back().key.push_back(c);
-          } else fail();
-        break;
-        case FIELD_LIMBO:
-          if (std::isspace(c)) break;
-          else if (std::isalpha(c)) {
-            entries.back().fields.push_back(Field());
-            entries.back().fields.back().name.push_back(c);
-            state = FIELD_NAME;
-          } else if (c == '}') state = LIMBO;
-          else if (c == ',') break;
-          else fail();
-        break;
-        case FIELD_NAME:
-          if (std::isspace(c)) break;
-          else if (isident(c)) {
-            entries.back().fields.back().name.push_back(c);
-          } else if (c == '=') {
-            make_lowercase(entries.back().fields.back().name);
-            state = FIELD_POST_EQUAL;
-          } else fail();
-        break;
-        case FIELD_POST_EQUAL:
-          if (std::isspace(c)) break;
-          else if (c == '{') {
-            state = FIELD_VALUE_TEXT;
-            value_limit() = FVL_CURLY;
-          } else if (c == '"') {
-            state = FIELD_VALUE_TEXT;
-            value_limit() = FVL_QUOTE;
-          } else if (std::isprint(c)) {
-            value_limit() = FVL_NONE;
-            handle_curly();
-            handle_quote();
-            entries.back().fields.back().value.push_back(c);
-            state = FIELD_VALUE_TEXT;
-          } else fail();
-        break;
-        case FIELD_VALUE_TEXT:
-          if (field_value_ended()) {
-            state = FIELD_LIMBO;
-          } else if (std::isspace(c)) {
-            state = FIELD_VALUE_SPACE;
-          } else if (std::isprint(c)) {
-            handle_curly();
-            handle_quote();
-            entries.back().fields.back().value.push_back(c);
-          } else fail();
-        break;
-        case FIELD_VALUE_SPACE:
-          if (field_value_ended()) {
-            state = FIELD_LIMBO;
-          } else if (std::isspace(c)) {
-            break;
-          } else if (std::isprint(c)) {
-            handle_curly();
-            handle_quote();
-            entries.back().fields.back().value.push_back(' ');
-            entries.back().fields.back().value.push_back(c);
-            state = FIELD_VALUE_TEXT;
-          } else fail();
-        break;
-        case COMMENT:
-          if (c == '\n') state = LIMBO;
-          else entries.back().comment.push_back(c);
-        break;
-      }
-      if (c == '\n') {
-        ++line;
-        column = 0;
+  }
+
+  void run(std::istream& stream) {
+    start();
+    for (; stream.get(c); ++offset) step();
+    if (state != LIMBO) throw ParseError("File ended early\n");
+  }
+
+  /* parses the next batch_size complete entries (fewer at the
+     end of the stream) into batch, so callers need not keep the
+     whole file resident. call start() first.
+     returns false once the stream is exhausted */
+  bool run_batch(std::istream& stream, Entries& batch, size_t batch_size) {
+    batch.clear();
+    for (; stream.get(c); ++offset) {
+      step();
+      if (state == LIMBO && entries.size() >= batch_size) {
+        ++offset;
+        batch.swap(entries);
+        return true;
       }
     }
-    if (state != LIMBO) {
-      std::cout << "File ended early\n";
-      exit(-1);
-    }
+    if (state != LIMBO) throw ParseError("File ended early\n");
+    batch.swap(entries);
+    return !batch.empty();
   }
 
   Entries& get_entries() { return entries; }
@@ -271,31 +558,33 @@ public:
 };
 
 void Parser::fail() {
-  std::cout << "Parse error at line " << line << " column " << column;
-  std::cout << " char " << c;
-  std::cout << " state \"";
+  std::stringstream msg;
+  msg << "Parse error at line " << line << " column " << column;
+  msg << " char " << c;
+  msg << " state \"";
   switch (state) {
-    case LIMBO: std::cout << "limbo"; break;
-    case ENTRY_TYPE: std::cout << "entry type"; break;
-    case ENTRY_KEY: std::cout << "entry key"; break;
-    case FIELD_LIMBO: std::cout << "field limbo"; break;
-    case FIELD_NAME: std::cout << "field name"; break;
-    case FIELD_POST_EQUAL: std::cout << "field post equal"; break;
-    case FIELD_VALUE_TEXT: std::cout << "field value text"; break;
-    case FIELD_VALUE_SPACE: std::cout << "field value space"; break;
-    case COMMENT: std::cout << "comment"; break;
-  }
-  std::cout << "\"\n";
-  std::cout << "curly depth " << curly_depth;
-  std::cout << " value delimiter ";
-  switch (value_limit()) {
-    case FVL_NONE: std::cout << "none"; break;
-    case FVL_CURLY: std::cout << "}"; break;
-    case FVL_QUOTE: std::cout << "\""; break;
-  }
-  std::cout << '\n';
-  print_entries(std::cout, entries);
-  exit(-1);
+    case LIMBO: msg << "limbo"; break;
+    case ENTRY_TYPE: msg << "entry type"; break;
+    case ENTRY_KEY: msg << "entry key"; break;
+    case FIELD_LIMBO: msg << "field limbo"; break;
+    case FIELD_NAME: msg << "field name"; break;
+    case FIELD_POST_EQUAL: msg << "field post equal"; break;
+    case FIELD_VALUE_TEXT: msg << "field value text"; break;
+    case FIELD_VALUE_SPACE: msg << "field value space"; break;
+    case COMMENT: msg << "comment"; break;
+  }
+  msg << "\"\n";
+  msg << "curly depth " << curly_depth;
+  if (!entries.empty() && !entries.back().fields.empty()) {
+    msg << " value delimiter ";
+    switch (value_limit()) {
+      case FVL_NONE: msg << "none"; break;
+      case FVL_CURLY: msg << "}"; break;
+      case FVL_QUOTE: msg << "\""; break;
+    }
+  }
+  msg << '\n';
+  throw ParseError(msg.str());
 }
 
 static void print_field2(std::ostream& stream, Field const& field) {
@@ -372,6 +661,7 @@ static void comment_out_urls(Entries& entries) {
     }
     if (j != entry.fields.size()) {
       entry.fields.erase(entry.fields.begin() + j);
+      entry.modified = true;
       entries.insert(entries.begin() + i, new_entry);
     }
   }
@@ -380,8 +670,10 @@ static void comment_out_urls(Entries& entries) {
 static void remove_fields(Entries& entries, std::string const& name) {
   for (auto& entry : entries) {
     for (auto it = begin(entry.fields); it != end(entry.fields);) {
-      if (it->name == name) entry.fields.erase(it);
-      else ++it;
+      if (it->name == name) {
+        it = entry.fields.erase(it);
+        entry.modified = true;
+      } else ++it;
     }
   }
 }
@@ -390,8 +682,10 @@ static void remove_type_fields(Entries& entries, std::string const& type, std::s
   for (auto& entry : entries) {
     if (entry.type != type) continue;
     for (auto it = begin(entry.fields); it != end(entry.fields);) {
-      if (it->name == name) entry.fields.erase(it);
-      else ++it;
+      if (it->name == name) {
+        it = entry.fields.erase(it);
+        entry.modified = true;
+      } else ++it;
     }
   }
 }
@@ -403,6 +697,7 @@ static void rename_fields(Entries& entries, std::string const& from, std::string
         auto existing_it = find_field(entry, to);
         if (existing_it != entry.fields.end()) entry.fields.erase(existing_it);
         field.name = to;
+        entry.modified = true;
       }
     }
   }
@@ -612,38 +907,115 @@ static std::string unsplit_text(StringVector const& v) {
   return s;
 }
 
+/* unsplit_text, keeping the trailing space of an @string
+   definition like "Proc. of the " that text is appended to */
+static std::string unsplit_text_like(std::string const& value, StringVector const& v) {
+  auto s = unsplit_text(v);
+  if (!value.empty() && value.back() == ' ') s.push_back(' ');
+  return s;
+}
+
+static StringVector split_words(std::string const& s) {
+  std::stringstream stream(s);
+  StringVector v;
+  std::string word;
+  while (stream >> word) v.push_back(word);
+  return v;
+}
+
+/* applies f to the text of each quoted or braced string in
+   a macro expression such as  proc # " on Supercomputing" ,
+   keeping the delimiters, numbers, macro names and #s */
+static std::string map_expression_strings(std::string const& expr,
+    std::function<std::string(std::string const&)> const& f) {
+  std::string s;
+  size_t i = 0;
+  while (i < expr.size()) {
+    char open = expr[i];
+    if (open != '"' && open != '{') {
+      s.push_back(open);
+      ++i;
+      continue;
+    }
+    char close = open == '"' ? '"' : '}';
+    int depth = 0;
+    size_t end = i + 1;
+    for (; end < expr.size(); ++end) {
+      if (expr[end] == close && depth == 0) break;
+      if (expr[end] == '{') ++depth;
+      if (expr[end] == '}') --depth;
+    }
+    if (end == expr.size()) return expr;
+    auto text = expr.substr(i + 1, end - i - 1);
+    auto mapped = f(text);
+    /* the space in  mar # " 20, 2017"  is part of the value */
+    if (!text.empty() && text[0] == ' ' && (mapped.empty() || mapped[0] != ' '))
+      mapped.insert(0, " ");
+    s.push_back(open);
+    s += mapped;
+    s.push_back(close);
+    i = end + 1;
+  }
+  return s;
+}
+
+struct AbbrevTables {
+  StringMap abbrevs;
+  StringSet procs;
+  StringSet preps;
+};
+
+/* built once and shared by every caller, including
+   the worker threads of the server */
+static AbbrevTables const& get_abbrev_tables() {
+  static AbbrevTables const tables = {
+    get_abbreviations(),
+    get_abbrev_proc_names(),
+    get_prepositions()
+  };
+  return tables;
+}
+
 static void abbreviate(Entries& entries) {
-  auto abbrevs = get_abbreviations();
-  auto procs = get_abbrev_proc_names();
-  auto preps = get_prepositions();
+  auto const& tables = get_abbrev_tables();
+  auto const& abbrevs = tables.abbrevs;
+  auto const& procs = tables.procs;
+  auto const& preps = tables.preps;
+  auto abbreviate_text = [&](std::string const& value) -> std::string {
+    auto words = split_text(value);
+    /* first abbreviate single words */
+    for (auto& word : words) {
+      auto lword = as_lowercase(word); /* case-insensitive match */
+      auto it = abbrevs.find(lword);
+      if (it != abbrevs.end()) word = it->second;
+    }
+    /* then remove prepositions after abbreviated proceedings */
+    for (size_t i = 0; i < words.size(); ++i) {
+      if (procs.count(words[i])) {
+        if ((i + 1 < words.size()) && preps.count(words[i + 1])) {
+          if ((i + 2 < words.size()) && words[i + 2] == "the") {
+            words.erase(words.begin() + i + 2);
+          }
+          words.erase(words.begin() + i + 1);
+        }
+      }
+    }
+    return unsplit_text_like(value, words);
+  };
   for (auto& entry : entries) {
     for (auto& field : entry.fields) {
-      if (entry.type == "string" ||
+      /* macro uses are left alone, their definitions are abbreviated,
+         string by string when they are built with # */
+      if (field.limit == FVL_NONE && entry.type == "string") {
+        set_value(entry, field, map_expression_strings(field.value, abbreviate_text));
+      } else if (entry.type == "string" ||
           field.name == "journal" ||
           field.name == "organization" ||
           field.name == "institution" ||
           field.name == "department" ||
           field.name == "school" ||
           (field.name == "booktitle" && entry.type != "inbook")) {
-        auto words = split_text(field.value);
-        /* first abbreviate single words */
-        for (auto& word : words) {
-          auto lword = as_lowercase(word); /* case-insensitive match */
-          auto it = abbrevs.find(lword);
-          if (it != abbrevs.end()) word = it->second;
-        }
-        /* then remove prepositions after abbreviated proceedings */
-        for (size_t i = 0; i < words.size(); ++i) {
-          if (procs.count(words[i])) {
-            if ((i + 1 < words.size()) && preps.count(words[i + 1])) {
-              if ((i + 2 < words.size()) && words[i + 2] == "the") {
-                words.erase(words.begin() + i + 2);
-              }
-              words.erase(words.begin() + i + 1);
-            }
-          }
-        }
-        field.value = unsplit_text(words);
+        set_value(entry, field, abbreviate_text(field.value));
       }
     }
   }
@@ -651,107 +1023,83 @@ static void abbreviate(Entries& entries) {
 
 static void escape_ampersand(Entries& entries) {
   StringSet field_names = { "publisher", "journal" };
+  auto escape_text = [](std::string const& value) -> std::string {
+    auto words = split_text(value);
+    for (auto& word : words) if (word == "&") word = "\\&";
+    return unsplit_text_like(value, words);
+  };
   for (auto& entry : entries) {
     for (auto& field : entry.fields) {
-      if (field_names.count(field.name)) {
-        auto words = split_text(field.value);
-        for (auto& word : words) if (word == "&") word = "\\&";
-        field.value = unsplit_text(words);
-      }
+      if (field.limit == FVL_NONE && entry.type == "string")
+        set_value(entry, field, map_expression_strings(field.value, escape_text));
+      else if (entry.type == "string" || field_names.count(field.name))
+        set_value(entry, field, escape_text(field.value));
     }
   }
 }
 
 static void conference_to_inproceedings(Entries& entries) {
-  for (auto& entry : entries)
-    if (entry.type == "conference")
+  for (auto& entry : entries) {
+    if (entry.type == "conference") {
       entry.type = "inproceedings";
+      entry.modified = true;
+    }
+  }
 }
 
-static bool has_indirect_field(Entries const& entries, Entry const& entry,
+static bool has_indirect_field(std::ostream& log,
+    Entries const& entries, Entry const& entry,
     std::string const& field_name) {
   if (has_field(entry, field_name)) return true;
   if (!has_field(entry, "crossref")) return false;
   auto other_name = get_field(entry, "crossref");
   if (!has_entry(entries, other_name)) {
-    std::cout << "WARNING: " << entry.key << " crossref " << other_name << " not found\n";
+    log << "WARNING: " << entry.key << " crossref " << other_name << " not found\n";
     return false;
   }
   auto other = get_entry(entries, other_name);
   return has_field(other, field_name);
 }
 
-static void warn_missing_field(Entries const& entries, Entry const& entry, std::string const& field_name) {
-  if (!has_indirect_field(entries, entry, field_name))
-    std::cout << entry.key << " has no " << field_name << "\n";
+static void warn_missing_field(std::ostream& log, Entries const& entries,
+    Entry const& entry, std::string const& field_name) {
+  if (!has_indirect_field(log, entries, entry, field_name))
+    log << entry.key << " has no " << field_name << "\n";
 }
 
-static void warn_missing_fields(Entries& entries) {
-  for (auto& entry : entries) {
-    if (entry.type == "inproceedings") {
-      warn_missing_field(entries, entry, "title");
-      warn_missing_field(entries, entry, "booktitle");
-      warn_missing_field(entries, entry, "author");
-      warn_missing_field(entries, entry, "year");
-      warn_missing_field(entries, entry, "month");
-      warn_missing_field(entries, entry, "day");
-      warn_missing_field(entries, entry, "pages");
-    } else if (entry.type == "article") {
-      warn_missing_field(entries, entry, "title");
-      warn_missing_field(entries, entry, "author");
-      warn_missing_field(entries, entry, "year");
-      warn_missing_field(entries, entry, "month");
-      warn_missing_field(entries, entry, "volume");
-      warn_missing_field(entries, entry, "number");
-      warn_missing_field(entries, entry, "pages");
-    } else if (entry.type == "electronic") {
-      warn_missing_field(entries, entry, "title");
-      warn_missing_field(entries, entry, "author");
-      warn_missing_field(entries, entry, "url");
-      warn_missing_field(entries, entry, "urldate");
-    } else if (entry.type == "book") {
-      warn_missing_field(entries, entry, "title");
-      warn_missing_field(entries, entry, "author");
-      warn_missing_field(entries, entry, "publisher");
-      warn_missing_field(entries, entry, "address");
-      warn_missing_field(entries, entry, "year");
-    } else if (entry.type == "inbook") {
-      warn_missing_field(entries, entry, "booktitle");
-      warn_missing_field(entries, entry, "author");
-      warn_missing_field(entries, entry, "publisher");
-      warn_missing_field(entries, entry, "address");
-      warn_missing_field(entries, entry, "year");
-    } else if (entry.type == "techreport") {
-      warn_missing_field(entries, entry, "title");
-      warn_missing_field(entries, entry, "author");
-      warn_missing_field(entries, entry, "institution");
-      warn_missing_field(entries, entry, "address");
-      warn_missing_field(entries, entry, "number");
-      warn_missing_field(entries, entry, "year");
-    } else if (entry.type == "phdthesis") {
-      warn_missing_field(entries, entry, "title");
-      warn_missing_field(entries, entry, "author");
-      warn_missing_field(entries, entry, "school");
-      warn_missing_field(entries, entry, "department");
-      warn_missing_field(entries, entry, "address");
-      warn_missing_field(entries, entry, "year");
-    } else if (entry.type == "mastersthesis") {
-      warn_missing_field(entries, entry, "title");
-      warn_missing_field(entries, entry, "author");
-      warn_missing_field(entries, entry, "school");
-      warn_missing_field(entries, entry, "address");
-      warn_missing_field(entries, entry, "year");
-    }
-  }
+/* the fields IEEE style wants for each entry type */
+static StringVector const& get_required_fields(std::string const& type) {
+  static std::map<std::string, StringVector> const required = {
+    {"inproceedings", {"title", "booktitle", "author", "year", "month", "day", "pages"}},
+    {"article", {"title", "author", "year", "month", "volume", "number", "pages"}},
+    {"electronic", {"title", "author", "url", "urldate"}},
+    {"book", {"title", "author", "publisher", "address", "year"}},
+    {"inbook", {"booktitle", "author", "publisher", "address", "year"}},
+    {"techreport", {"title", "author", "institution", "address", "number", "year"}},
+    {"phdthesis", {"title", "author", "school", "department", "address", "year"}},
+    {"mastersthesis", {"title", "author", "school", "address", "year"}}
+  };
+  static StringVector const none;
+  auto it = required.find(type);
+  if (it == required.end()) return none;
+  return it->second;
+}
+
+static void warn_missing_fields(std::ostream& log, Entries const& entries) {
+  for (auto const& entry : entries)
+    for (auto const& field_name : get_required_fields(entry.type))
+      warn_missing_field(log, entries, entry, field_name);
 }
 
 static void remove_empty_fields(Entries& entries) {
   for (auto& entry : entries) {
     for (size_t i = 0; i < entry.fields.size();) {
-      if (entry.fields[i].value.size() == 0)
+      if (entry.fields[i].value.size() == 0) {
         entry.fields.erase(entry.fields.begin() + i);
-      else
+        entry.modified = true;
+      } else {
         ++i;
+      }
     }
   }
 }
@@ -771,39 +1119,57 @@ static char const* const month_names[] = {
   "December"
 };
 
+/* every prefix of three or more letters of a
+   lowercase month name, and the month's number */
+static std::unordered_map<std::string, int> const& get_month_prefixes() {
+  static std::unordered_map<std::string, int> const prefixes = []() {
+    std::unordered_map<std::string, int> m;
+    for (size_t i = 0; i < ARRAY_SIZE(month_names); ++i) {
+      auto name = as_lowercase(month_names[i]);
+      for (size_t n = 3; n <= name.length(); ++n) m[name.substr(0, n)] = int(i + 1);
+    }
+    return m;
+  }();
+  return prefixes;
+}
+
+/* 1 to 12 if value starts with a word that is case-insensitively
+   a prefix of a month name, otherwise 0. length is that of the word. */
+static int leading_month(std::string const& value, size_t& length) {
+  length = 0;
+  while (length < value.length() && std::isalpha(value[length])) ++length;
+  if (length < 3) return 0;
+  auto const& prefixes = get_month_prefixes();
+  auto it = prefixes.find(as_lowercase(value.substr(0, length)));
+  if (it == prefixes.end()) return 0;
+  return it->second;
+}
+
+/* 1 to 12, or 0 if value does not start with a month name */
+static int month_number(std::string const& value) {
+  size_t length;
+  return leading_month(value, length);
+}
+
 /* find a first word in the month field that is case-insensitively
    a prefix of a month name, and replace it with the first
    three characters of that month name, which is the magic
    identifier understood by bibtex.
    also remove quotes or braces around this field value */
 static void fix_months(Entries& entries) {
-  StringVector months;
-  for (size_t i = 0; i < ARRAY_SIZE(month_names); ++i) {
-    std::string month_name(month_names[i]);
-    make_lowercase(month_name);
-    months.push_back(month_name);
-  }
   for (auto& entry : entries) {
     auto it = find_field(entry, "month");
     if (it == entry.fields.end()) continue;
     auto& field = *it;
-    std::string word;
-    for (auto c : field.value) {
-      if (std::isalpha(c)) word.push_back(std::tolower(c));
-      else break;
-    }
-    auto orig_len = word.length();
-    if (word.length() >= 3) {
-      for (auto month : months) {
-        auto res = month.compare(0, word.length(), word);
-        if (res == 0) {
-          word = month.substr(0, 3);
-          break;
-        }
-      }
+    size_t length;
+    int month = leading_month(field.value, length);
+    auto word = month ? as_lowercase(month_names[month - 1]).substr(0, 3) :
+      as_lowercase(field.value.substr(0, length));
+    set_value(entry, field, word + field.value.substr(length, std::string::npos));
+    if (field.limit != FVL_NONE) {
+      field.limit = FVL_NONE;
+      entry.modified = true;
     }
-    field.value = word + field.value.substr(orig_len, std::string::npos);
-    field.limit = FVL_NONE;
   }
 }
 
@@ -824,8 +1190,8 @@ static void remove_unwanted_fields(Entries& entries) {
   remove_type_fields(entries, "techreport", "month");
 }
 
-static std::string unify_dashed_value(std::string const& value,
-    bool must_have_dash) {
+static std::string unify_dashed_value(std::ostream& log,
+    std::string const& value, bool must_have_dash) {
   enum { LEFT_SPACE, LEFT, DASH, RIGHT, RIGHT_SPACE } state = LEFT_SPACE;
   std::string left_str;
   std::string right_str;
@@ -853,7 +1219,7 @@ static std::string unify_dashed_value(std::string const& value,
         break;
       case RIGHT_SPACE:
         if (!(std::isspace(value[i]))) {
-          std::cout << "too many spaces in dashed value \"" << value << "\"\n";
+          log << "too many spaces in dashed value \"" << value << "\"\n";
           return value;
         }
         break;
@@ -861,66 +1227,3440 @@ static std::string unify_dashed_value(std::string const& value,
   }
   if (!(state == RIGHT || state == RIGHT_SPACE)) {
     if (must_have_dash) {
-      std::cout << "expected dash in value \"" << value << "\"\n";
+      log << "expected dash in value \"" << value << "\"\n";
     }
     return value;
   }
   return left_str + "-" + right_str;
 }
 
-static void unify_dashes(Entries& entries) {
+static void unify_dashes(std::ostream& log, Entries& entries) {
   for (auto& entry : entries) {
     for (auto& field : entry.fields) {
       if (field.name == "pages") {
-        field.value = unify_dashed_value(field.value, true);
+        set_value(entry, field, unify_dashed_value(log, field.value, true));
       }
       if ((field.name == "number" && entry.type != "techreport") ||
           (field.name == "day")) {
-        field.value = unify_dashed_value(field.value, false);
+        set_value(entry, field, unify_dashed_value(log, field.value, false));
       }
     }
   }
 }
 
-int main(int argc, char** argv) {
-  bool inplace = false;
-  const char* inpath = nullptr;
-  const char* outpath = nullptr;
-  for (int i = 1; i < argc; ++i) {
-    if (std::string("-i") == argv[i]) inplace = true;
-    else if (!inpath) inpath = argv[i];
-    else if (!outpath) outpath = argv[i];
-  }
-  if (inplace) outpath = inpath;
-  if (!inpath || !outpath) {
-    std::cout << "usage: " << argv[0] << " input.bib output.bib\n";
-    std::cout << "       " << argv[0] << " -i inout.bib\n";
-    return -1;
+/* a plain number of at most nine digits */
+static bool parse_integer(std::string const& s, int& n) {
+  if (s.empty() || s.length() > 9) return false;
+  for (auto c : s)
+    if (!std::isdigit(c)) return false;
+  n = std::atoi(s.c_str());
+  return true;
+}
+
+/* reads the typed value of a field from its normalized text:
+   "2015" years, months as fix_months leaves them or 1 to 12,
+   and "12" or "12-15" pages, numbers and days */
+static void parse_field_type(Field& field) {
+  auto const& value = field.value;
+  field.type = FT_TEXT;
+  if (field.name == "month") {
+    size_t length;
+    int month = leading_month(value, length);
+    if (month || (parse_integer(value, month) && month >= 1 && month <= 12)) {
+      field.type = FT_MONTH;
+      field.first = field.last = month;
+    }
+  } else if (field.name == "year") {
+    if (parse_integer(value, field.first)) {
+      field.type = FT_NUMBER;
+      field.last = field.first;
+    }
+  } else if (field.name == "pages" || field.name == "number" || field.name == "day") {
+    auto dash = value.find('-');
+    if (dash == std::string::npos) {
+      if (parse_integer(value, field.first)) {
+        field.type = FT_NUMBER;
+        field.last = field.first;
+      }
+    } else if (parse_integer(value.substr(0, dash), field.first) &&
+               parse_integer(value.substr(dash + 1), field.last)) {
+      field.type = FT_RANGE;
+    }
   }
-  Parser parser;
-  {
-    std::ifstream file(inpath);
-    if (!file.is_open()) {
-      std::cout << "could not open " << inpath << " for reading\n";
-      return -1;
+}
+
+/* the last pass: types the fields the others have normalized,
+   so that sorting, queries and export read numbers
+   instead of parsing the text again */
+/* pages that do not type as numbers but are still fine, such as
+   the C47-C75 of SIAM or the 29:1-29:28 of ACM, have digits on
+   both sides of the dash. pages without a dash already got
+   "expected dash" from unify_dashes. */
+static bool is_page_range_like(std::string const& value) {
+  auto dash = value.find('-');
+  if (dash == std::string::npos) return true;
+  auto has_digit = [&](size_t b, size_t e) {
+    return std::any_of(value.begin() + b, value.begin() + e, ::isdigit);
+  };
+  return has_digit(0, dash) && has_digit(dash + 1, value.size());
+}
+
+static void type_fields(std::ostream& log, Entries& entries) {
+  for (auto& entry : entries) {
+    for (auto& field : entry.fields) {
+      if (field.type != FT_UNPARSED) continue;
+      parse_field_type(field);
+      if (field.type != FT_TEXT) continue;
+      if (field.name == "year")
+        log << entry.key << " year \"" << field.value << "\" is not a number\n";
+      else if (field.name == "month")
+        log << entry.key << " month \"" << field.value << "\" is not a month\n";
+      else if (field.name == "day")
+        log << entry.key << " day \"" << field.value << "\" is not a day or range of days\n";
+      else if (field.name == "pages" && !is_page_range_like(field.value))
+        log << entry.key << " pages \"" << field.value << "\" is not a range of pages\n";
     }
-    parser.run(file);
   }
-  auto& entries = parser.get_entries();
-  conference_to_inproceedings(entries);
-  remove_unwanted_fields(entries);
-  comment_out_urls(entries);
-  abbreviate(entries);
-  escape_ampersand(entries);
-  fix_months(entries);
-  unify_dashes(entries);
-  warn_missing_fields(entries);
-  {
-    std::ofstream file(outpath);
-    if (!file.is_open()) {
-      std::cout << "could not open " << outpath << " for writing\n";
-      return -1;
+}
+
+/* the first number of a field: its typed value, or the first
+   digits in its text, so that "2017 submitted" still counts
+   as 2017. fields no pass has typed are parsed here. */
+static bool field_number(Field const& field, int& n) {
+  if (field.type == FT_UNPARSED) {
+    auto typed = field;
+    parse_field_type(typed);
+    return field_number(typed, n);
+  }
+  if (field.type != FT_TEXT) {
+    n = field.first;
+    return true;
+  }
+  auto b = std::find_if(begin(field.value), end(field.value), ::isdigit);
+  if (b == end(field.value)) return false;
+  n = std::atoi(&*b);
+  return true;
+}
+
+/* BibTeX names, as described in "Tame the BeaST" section 11:
+   "First von Last", "von Last, First" or "von Last, Jr, First",
+   separated by " and " outside of braces. */
+struct Person {
+  std::string first;
+  std::string von;
+  std::string last;
+  std::string jr;
+};
+
+/* splits s at each top-level occurrence of sep (case-insensitive) */
+static StringVector split_top_level(std::string const& s, std::string const& sep) {
+  StringVector parts(1);
+  int depth = 0;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '{') ++depth;
+    if (s[i] == '}') --depth;
+    if (depth == 0 && s.size() - i >= sep.size() &&
+        as_lowercase(s.substr(i, sep.size())) == sep) {
+      parts.push_back(std::string());
+      i += sep.size() - 1;
+      continue;
+    }
+    parts.back().push_back(s[i]);
+  }
+  return parts;
+}
+
+static std::string trim(std::string const& s) {
+  auto b = s.find_first_not_of(' ');
+  if (b == std::string::npos) return std::string();
+  return s.substr(b, s.find_last_not_of(' ') - b + 1);
+}
+
+static std::string join_words(StringVector const& words, size_t b, size_t e) {
+  std::string s;
+  for (size_t i = b; i < e; ++i) {
+    if (i != b) s.push_back(' ');
+    s += words[i];
+  }
+  return s;
+}
+
+/* von words are the ones starting with a lowercase letter */
+static bool is_von_word(std::string const& word) {
+  for (auto c : word) {
+    if (c == '{' || c == '}' || c == '\\') continue;
+    return std::islower(c);
+  }
+  return false;
+}
+
+/* the names in an author or editor list, including the
+   empty ones a doubled "and" leaves behind */
+static StringVector split_authors(std::string const& value) {
+  StringVector names(1);
+  for (auto const& word : split_top_level(value, " ")) {
+    if (word.empty()) continue;
+    if (as_lowercase(word) == "and") {
+      names.push_back(std::string());
+    } else {
+      if (!names.back().empty()) names.back().push_back(' ');
+      names.back() += word;
+    }
+  }
+  return names;
+}
+
+static Person parse_person(std::string const& name) {
+  Person person;
+  auto parts = split_top_level(name, ",");
+  for (auto& part : parts) part = trim(part);
+  auto words = split_top_level(parts[0], " ");
+  words.erase(std::remove(words.begin(), words.end(), std::string()), words.end());
+  if (words.empty()) return person;
+  size_t von_begin, von_end;
+  if (parts.size() == 1) {
+    /* First von Last: the last word is always Last */
+    von_begin = 0;
+    while (von_begin + 1 < words.size() && !is_von_word(words[von_begin])) ++von_begin;
+    if (von_begin + 1 == words.size()) von_begin = words.size() - 1;
+    von_end = von_begin;
+    for (size_t i = von_begin; i + 1 < words.size(); ++i)
+      if (is_von_word(words[i])) von_end = i + 1;
+    person.first = join_words(words, 0, von_begin);
+  } else {
+    /* von Last, [Jr,] First */
+    von_begin = 0;
+    von_end = 0;
+    for (size_t i = 0; i + 1 < words.size(); ++i)
+      if (is_von_word(words[i])) von_end = i + 1;
+    person.first = parts.back();
+    if (parts.size() > 2) person.jr = parts[1];
+  }
+  person.von = join_words(words, von_begin, von_end);
+  person.last = join_words(words, von_end, words.size());
+  return person;
+}
+
+static std::string full_last_name(Person const& person) {
+  if (person.von.empty()) return person.last;
+  return person.von + " " + person.last;
+}
+
+static std::string format_last_first(Person const& person) {
+  auto s = full_last_name(person);
+  if (!person.jr.empty()) s += ", " + person.jr;
+  if (!person.first.empty()) s += ", " + person.first;
+  return s;
+}
+
+static std::string format_first_last(Person const& person) {
+  if (!person.jr.empty()) return format_last_first(person);
+  auto s = person.first;
+  if (!s.empty()) s.push_back(' ');
+  return s + full_last_name(person);
+}
+
+/* what identifies a person: case, braces and
+   periods after initials do not matter */
+static std::string person_id_key(Person const& person) {
+  std::string s;
+  auto add = [&](std::string const& part) {
+    for (auto c : part)
+      if (c != '{' && c != '}' && c != '.')
+        s.push_back(std::tolower(c));
+    s.push_back('|');
+  };
+  add(full_last_name(person));
+  add(person.jr);
+  auto first = split_words(person.first);
+  add(join_words(first, 0, first.size()));
+  return s;
+}
+
+/* every distinct person gets a small id, so that entries
+   can refer to their authors as id arrays and the group
+   members who appear on hundreds of papers are stored once.
+   one table serves every file, and since files are
+   normalized on all cores each call takes the lock */
+class AuthorTable {
+  mutable std::mutex mutex;
+  /* a deque so that get() references stay valid */
+  std::deque<Person> people;
+  std::unordered_map<std::string, uint32_t> ids;
+  /* by the last name part of person_id_key */
+  std::unordered_map<std::string, AuthorIds> by_last;
+
+  static std::string last_key(std::string const& key) {
+    return key.substr(0, key.find('|') + 1);
+  }
+
+public:
+
+  uint32_t intern(Person const& person) {
+    auto key = person_id_key(person);
+    std::lock_guard<std::mutex> guard(mutex);
+    auto result = ids.insert(std::make_pair(key, uint32_t(people.size())));
+    if (result.second) {
+      people.push_back(person);
+      by_last[last_key(key)].push_back(result.first->second);
+    }
+    return result.first->second;
+  }
+
+  Person const& get(uint32_t id) const {
+    std::lock_guard<std::mutex> guard(mutex);
+    return people[id];
+  }
+
+  /* ids of everyone with the same last name and,
+     if the pattern has one, the same first name */
+  AuthorIds find(Person const& pattern) const {
+    auto key = person_id_key(pattern);
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = by_last.find(last_key(key));
+    if (it == by_last.end()) return AuthorIds();
+    if (pattern.first.empty() && pattern.jr.empty()) return it->second;
+    AuthorIds found;
+    for (auto id : it->second)
+      if (person_id_key(people[id]) == key) found.push_back(id);
+    return found;
+  }
+};
+
+static AuthorTable& get_author_table() {
+  static AuthorTable table;
+  return table;
+}
+
+/* positions of the entries written by each author id */
+using AuthorIndex = std::vector<std::vector<uint32_t>>;
+
+static AuthorIndex build_author_index(Entries const& entries) {
+  AuthorIndex index;
+  for (size_t i = 0; i < entries.size(); ++i)
+    for (auto id : entries[i].authors) {
+      if (id >= index.size()) index.resize(id + 1);
+      if (index[id].empty() || index[id].back() != i) index[id].push_back(uint32_t(i));
+    }
+  return index;
+}
+
+enum AuthorStyle {
+  AUTHORS_KEEP,
+  AUTHORS_LAST_FIRST,
+  AUTHORS_FIRST_LAST
+};
+
+static bool parse_author_style(std::string const& name, AuthorStyle& style) {
+  if (name == "keep") style = AUTHORS_KEEP;
+  else if (name == "last-first") style = AUTHORS_LAST_FIRST;
+  else if (name == "first-last") style = AUTHORS_FIRST_LAST;
+  else return false;
+  return true;
+}
+
+/* an initial such as  A.  or  J.-P.  or the  AB  of  Smith AB */
+static bool is_initial(std::string const& word) {
+  std::string letters;
+  bool dotted = false;
+  for (auto c : word) {
+    if (c == '{' || c == '}' || c == '-') continue;
+    if (c == '.') dotted = true;
+    else letters.push_back(c);
+  }
+  if (letters.empty() || !std::all_of(letters.begin(), letters.end(), ::isupper)) return false;
+  return dotted || letters.size() <= 2;
+}
+
+static bool is_jr_part(std::string const& part) {
+  static StringSet const suffixes = { "jr", "sr", "ii", "iii", "iv" };
+  std::string s;
+  for (auto c : part) if (c != '.' && c != ' ') s.push_back(std::tolower(c));
+  return suffixes.count(s) != 0;
+}
+
+/* whether a "name" with commas is really several names separated
+   by commas: "Last, First" has no initials next to the last name
+   and "Last, Jr, First" has a suffix between them */
+static bool is_comma_list(std::string const& name) {
+  auto parts = split_top_level(name, ",");
+  if (parts.size() == 1) return false;
+  if (parts.size() > 3) return true;
+  if (parts.size() == 3 && !is_jr_part(trim(parts[1]))) return true;
+  auto words = split_top_level(trim(parts[0]), " ");
+  if (words.size() < 2) return false;
+  return std::any_of(words.begin(), words.end(), is_initial);
+}
+
+/* drops the empty names left by "and and",
+   warns about lists separated by commas instead of " and ",
+   optionally rewrites every name in one style,
+   and interns the authors into entry.authors */
+static void fix_author_lists(std::ostream& log, Entries& entries, AuthorStyle style) {
+  auto& table = get_author_table();
+  for (auto& entry : entries) {
+    entry.authors.clear();
+    for (size_t i = 0; i < entry.fields.size(); ++i) {
+      auto& field = entry.fields[i];
+      if (field.name != "author" && field.name != "editor") continue;
+      bool is_author = field.name == "author";
+      StringVector names;
+      for (auto const& name : split_authors(field.value)) {
+        if (name.empty()) continue;
+        if (is_comma_list(name)) {
+          log << "WARNING: " << entry.key << " " << field.name << " \"" << name
+            << "\" looks like several names, they should be separated by \" and \"\n";
+          names.push_back(name);
+        } else if (name == "others") {
+          names.push_back(name);
+        } else {
+          auto person = parse_person(name);
+          if (is_author) entry.authors.push_back(table.intern(person));
+          if (style == AUTHORS_KEEP) names.push_back(name);
+          else if (style == AUTHORS_LAST_FIRST) names.push_back(format_last_first(person));
+          else names.push_back(format_first_last(person));
+        }
+      }
+      /* nothing but "and"s, so let warn_missing_fields see it */
+      if (names.empty()) {
+        entry.fields.erase(entry.fields.begin() + i--);
+        entry.modified = true;
+        continue;
+      }
+      std::string value;
+      for (auto const& name : names) {
+        if (!value.empty()) value += " and ";
+        value += name;
+      }
+      set_value(entry, field, value);
     }
-    print_entries(file, entries);
   }
 }
+
+static bool write_all(int fd, char const* data, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    auto n = ::write(fd, data + done, size - done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    done += size_t(n);
+  }
+  return true;
+}
+
+static bool write_all(int fd, std::string const& s) {
+  return write_all(fd, s.data(), s.size());
+}
+
+/* appends bytes [begin, end) of in to out, letting the
+   kernel do the copy when both file systems allow it */
+static bool copy_range(int in, int out, size_t begin, size_t end) {
+  loff_t in_off = loff_t(begin);
+  size_t left = end - begin;
+  while (left) {
+    auto n = ::copy_file_range(in, &in_off, out, nullptr, left, 0);
+    if (n > 0) left -= size_t(n);
+    else if (n < 0 && errno == EINTR) continue;
+    else break;
+  }
+  char buf[1 << 16];
+  while (left) {
+    auto n = ::pread(in, buf, std::min(left, sizeof(buf)), in_off);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0 || !write_all(out, buf, size_t(n))) return false;
+    in_off += n;
+    left -= size_t(n);
+  }
+  return true;
+}
+
+/* whether every parsed entry is still present, in source order */
+static bool spans_line_up(Entries const& entries, size_t nparsed) {
+  size_t nspans = 0;
+  size_t end = 0;
+  for (auto const& entry : entries) {
+    if (!has_source(entry)) continue;
+    if (entry.source_begin < end) return false;
+    end = entry.source_end;
+    ++nspans;
+  }
+  return nspans == nparsed;
+}
+
+static bool read_range(int fd, size_t begin, size_t end,
+    std::string& s) {
+  s.resize(end - begin);
+  size_t done = 0;
+  while (done < s.size()) {
+    auto n = ::pread(fd, &s[done], s.size() - done, off_t(begin + done));
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    done += size_t(n);
+  }
+  return true;
+}
+
+/* the printed entry without its trailing newlines,
+   which is what replaces its source span */
+static std::string print_entry_span(Entry const& entry) {
+  std::stringstream stream;
+  print_entry(stream, entry);
+  auto s = stream.str();
+  s.erase(s.find_last_not_of('\n') + 1);
+  return s;
+}
+
+/* the file that writing to path would change, following
+   symlinks even when the last one dangles, so that replacing
+   it through a temporary file and rename() keeps the links */
+static std::string write_target(std::string path) {
+  char resolved[PATH_MAX];
+  if (::realpath(path.c_str(), resolved)) return resolved;
+  for (int hops = 0; hops < 40; ++hops) {
+    struct stat st;
+    if (::lstat(path.c_str(), &st) != 0 || !S_ISLNK(st.st_mode)) break;
+    auto n = ::readlink(path.c_str(), resolved, sizeof(resolved));
+    if (n <= 0 || size_t(n) == sizeof(resolved)) break;
+    std::string link(resolved, size_t(n));
+    auto slash = path.rfind('/');
+    if (link[0] != '/' && slash != std::string::npos)
+      link = path.substr(0, slash + 1) + link;
+    path = link;
+  }
+  return path;
+}
+
+/* rewrites the file entries were parsed from, copying the
+   source bytes of every entry that already prints as it reads
+   and printing only the others, so that in-place runs touch
+   (and git diffs show) just what changed, and leave the file
+   alone when nothing did.
+   entries created by a pass are printed in full
+   just before the next source entry.
+   requires spans_line_up() */
+static bool rewrite_in_place(char const* path, Entries const& entries) {
+  int in = ::open(path, O_RDONLY);
+  struct stat st;
+  if (in < 0 || ::fstat(in, &st) != 0) {
+    std::cout << "could not open " << path << " for reading\n";
+    if (in >= 0) ::close(in);
+    return false;
+  }
+  /* an entry keeps its source bytes only if printing it gives
+     back those same bytes, so that the parser's own normalization
+     (type case, quotes, spacing, layout) still reaches the file */
+  std::vector<std::string> printed(entries.size());
+  std::vector<bool> reprint(entries.size(), false);
+  bool changed = false;
+  std::string source;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    auto const& entry = entries[i];
+    if (!has_source(entry)) {
+      changed = true;
+      continue;
+    }
+    if (!entry.modified &&
+        !read_range(in, entry.source_begin, entry.source_end, source)) {
+      std::cout << "could not read " << path << "\n";
+      ::close(in);
+      return false;
+    }
+    auto text = print_entry_span(entry);
+    if (entry.modified || text != source) {
+      printed[i].swap(text);
+      reprint[i] = true;
+      changed = true;
+    }
+  }
+  if (!changed) {
+    ::close(in);
+    return true;
+  }
+  auto target = write_target(path);
+  std::string tmp_path = target + ".XXXXXX";
+  std::vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+  tmp_name.push_back('\0');
+  int out = ::mkstemp(tmp_name.data());
+  if (out < 0) {
+    std::cout << "could not open " << tmp_name.data() << " for writing\n";
+    ::close(in);
+    return false;
+  }
+  bool ok = true;
+  size_t pos = 0;
+  std::string pending;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    auto const& entry = entries[i];
+    if (!ok) break;
+    if (!has_source(entry)) {
+      std::stringstream stream;
+      print_entry(stream, entry);
+      pending += stream.str();
+      continue;
+    }
+    ok = copy_range(in, out, pos, entry.source_begin) &&
+      write_all(out, pending);
+    pending.clear();
+    if (!ok) break;
+    if (reprint[i])
+      ok = write_all(out, printed[i]);
+    else
+      ok = copy_range(in, out, entry.source_begin, entry.source_end);
+    pos = entry.source_end;
+  }
+  ok = ok && copy_range(in, out, pos, size_t(st.st_size)) &&
+    write_all(out, pending);
+  ok = ok && ::fchmod(out, st.st_mode & 07777) == 0;
+  ok = (::close(out) == 0) && ok;
+  ::close(in);
+  ok = ok && ::rename(tmp_name.data(), target.c_str()) == 0;
+  if (!ok) {
+    std::cout << "could not rewrite " << path << "\n";
+    ::unlink(tmp_name.data());
+  }
+  return ok;
+}
+
+/* gzip and zstd files are read and written through a thread
+   that does the (de)compression, handing 256 KiB chunks to or
+   from the parsing thread through a short queue, so the two
+   overlap and nothing is ever decompressed to disk.
+   Inputs are recognized by their first bytes, outputs by a
+   .gz or .zst suffix. zstd support comes from libzstd.so.1,
+   loaded when a zstd file is first seen. */
+
+enum Compression {
+  COMPRESSION_NONE,
+  COMPRESSION_GZIP,
+  COMPRESSION_ZSTD
+};
+
+static size_t const compression_chunk_size = size_t(1) << 18;
+
+static bool ends_with(std::string const& s, std::string const& suffix) {
+  return s.size() >= suffix.size() &&
+    s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static Compression compression_of_path(std::string const& path) {
+  if (ends_with(path, ".gz")) return COMPRESSION_GZIP;
+  if (ends_with(path, ".zst")) return COMPRESSION_ZSTD;
+  return COMPRESSION_NONE;
+}
+
+static Compression compression_of_magic(unsigned char const* magic, ssize_t n) {
+  if (n >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) return COMPRESSION_GZIP;
+  if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+    return COMPRESSION_ZSTD;
+  return COMPRESSION_NONE;
+}
+
+/* the few libzstd streaming calls used here, with the
+   buffer layouts of zstd.h, which has been stable since 1.0 */
+struct ZstdInBuffer {
+  void const* src;
+  size_t size;
+  size_t pos;
+};
+
+struct ZstdOutBuffer {
+  void* dst;
+  size_t size;
+  size_t pos;
+};
+
+enum {
+  ZSTD_CONTINUE = 0,
+  ZSTD_END = 2
+};
+
+struct ZstdApi {
+  void* (*create_dctx)();
+  size_t (*free_dctx)(void*);
+  size_t (*decompress_stream)(void*, ZstdOutBuffer*, ZstdInBuffer*);
+  void* (*create_cctx)();
+  size_t (*free_cctx)(void*);
+  size_t (*compress_stream2)(void*, ZstdOutBuffer*, ZstdInBuffer*, int);
+  unsigned (*is_error)(size_t);
+  char const* (*get_error_name)(size_t);
+};
+
+template <typename F>
+static bool load_symbol(void* lib, char const* name, F& f) {
+  auto p = ::dlsym(lib, name);
+  f = reinterpret_cast<F>(p);
+  return p != nullptr;
+}
+
+/* null if libzstd.so.1 (1.4 or later) is not installed */
+static ZstdApi const* get_zstd_api() {
+  static ZstdApi api;
+  static bool const loaded = []() {
+    auto lib = ::dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    return lib &&
+      load_symbol(lib, "ZSTD_createDCtx", api.create_dctx) &&
+      load_symbol(lib, "ZSTD_freeDCtx", api.free_dctx) &&
+      load_symbol(lib, "ZSTD_decompressStream", api.decompress_stream) &&
+      load_symbol(lib, "ZSTD_createCCtx", api.create_cctx) &&
+      load_symbol(lib, "ZSTD_freeCCtx", api.free_cctx) &&
+      load_symbol(lib, "ZSTD_compressStream2", api.compress_stream2) &&
+      load_symbol(lib, "ZSTD_isError", api.is_error) &&
+      load_symbol(lib, "ZSTD_getErrorName", api.get_error_name);
+  }();
+  return loaded ? &api : nullptr;
+}
+
+/* passes items from one thread to another, blocking
+   the producer while capacity items are waiting */
+template <typename T>
+class BoundedQueue {
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<T> items;
+  size_t capacity;
+  bool closed;
+
+public:
+
+  BoundedQueue(size_t c):capacity(c),closed(false) {}
+
+  /* false if the queue was closed, dropping item */
+  bool push(T&& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this]() { return closed || items.size() < capacity; });
+    if (closed) return false;
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  /* false once the queue is closed and drained */
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+    if (items.empty()) return false;
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  /* by the producer when it is done, or by the
+     consumer to make the producer give up */
+  void close() {
+    std::lock_guard<std::mutex> guard(mutex);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+};
+
+/* the decompressed contents of fd, decoded by a thread of
+   its own. a corrupt or truncated file throws ParseError from
+   the stream reading it, which must have badbit exceptions on. */
+class DecompressingBuf : public std::streambuf {
+  int fd;
+  Compression compression;
+  std::string path;
+  BoundedQueue<std::string> queue;
+  std::string chunk;
+  std::string error;
+  std::thread thread;
+
+  /* the next bytes of the file into buf, or false at the end */
+  bool read_more(char* buf, size_t& size) {
+    while (true) {
+      auto n = ::read(fd, buf, compression_chunk_size);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) error = std::strerror(errno);
+      if (n <= 0) return false;
+      size = size_t(n);
+      return true;
+    }
+  }
+
+  void decode_gzip() {
+    z_stream z;
+    std::memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, 15 + 32) != Z_OK) {
+      error = "out of memory";
+      return;
+    }
+    std::vector<char> in(compression_chunk_size);
+    bool ended = false;
+    bool full = false;
+    while (true) {
+      if (z.avail_in == 0 && !full) {
+        size_t size;
+        if (!read_more(in.data(), size)) {
+          if (error.empty() && !ended) error = "truncated gzip data";
+          break;
+        }
+        z.next_in = reinterpret_cast<Bytef*>(in.data());
+        z.avail_in = uInt(size);
+      }
+      std::string out(compression_chunk_size, '\0');
+      z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+      z.avail_out = uInt(out.size());
+      int ret = inflate(&z, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END) {
+        /* concatenated members, as written by pigz or cat */
+        ended = true;
+        inflateReset(&z);
+      } else if (ret == Z_OK) {
+        ended = false;
+      } else if (ret != Z_BUF_ERROR) {
+        error = z.msg ? z.msg : "corrupt gzip data";
+        break;
+      }
+      full = z.avail_out == 0;
+      out.resize(out.size() - z.avail_out);
+      if (!out.empty() && !queue.push(std::move(out))) break;
+    }
+    inflateEnd(&z);
+  }
+
+  void decode_zstd() {
+    auto api = get_zstd_api();
+    auto dctx = api->create_dctx();
+    std::vector<char> in(compression_chunk_size);
+    ZstdInBuffer input = {in.data(), 0, 0};
+    size_t pending = 0;
+    bool full = false;
+    while (true) {
+      if (input.pos == input.size && !full) {
+        if (!read_more(in.data(), input.size)) {
+          if (error.empty() && pending) error = "truncated zstd data";
+          break;
+        }
+        input.pos = 0;
+      }
+      std::string out(compression_chunk_size, '\0');
+      ZstdOutBuffer output = {&out[0], out.size(), 0};
+      pending = api->decompress_stream(dctx, &output, &input);
+      if (api->is_error(pending)) {
+        error = api->get_error_name(pending);
+        break;
+      }
+      full = output.pos == output.size;
+      out.resize(output.pos);
+      if (!out.empty() && !queue.push(std::move(out))) break;
+    }
+    api->free_dctx(dctx);
+  }
+
+  void decode() {
+    if (compression == COMPRESSION_GZIP) decode_gzip();
+    else decode_zstd();
+    queue.close();
+  }
+
+protected:
+
+  int_type underflow() override {
+    if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+    if (!queue.pop(chunk)) {
+      if (!error.empty()) throw ParseError(path + ": " + error + "\n");
+      return traits_type::eof();
+    }
+    setg(&chunk[0], &chunk[0], &chunk[0] + chunk.size());
+    return traits_type::to_int_type(chunk[0]);
+  }
+
+public:
+
+  DecompressingBuf(int f, Compression c, std::string const& p):
+    fd(f),compression(c),path(p),queue(4) {
+    thread = std::thread(&DecompressingBuf::decode, this);
+  }
+
+  ~DecompressingBuf() {
+    queue.close();
+    thread.join();
+    ::close(fd);
+  }
+};
+
+/* compresses what is written to it into fd on a thread of its own */
+class CompressingBuf : public std::streambuf {
+  int fd;
+  Compression compression;
+  BoundedQueue<std::string> queue;
+  std::string chunk;
+  std::string error;
+  std::thread thread;
+
+  void fail(std::string const& what) {
+    error = what;
+    queue.close();
+  }
+
+  bool write_out(char const* data, size_t size) {
+    if (write_all(fd, data, size)) return true;
+    fail(std::strerror(errno));
+    return false;
+  }
+
+  void encode_gzip() {
+    z_stream z;
+    std::memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      fail("out of memory");
+      return;
+    }
+    std::string in;
+    std::vector<char> out(compression_chunk_size);
+    for (bool more = true; more;) {
+      more = queue.pop(in);
+      z.next_in = reinterpret_cast<Bytef*>(&in[0]);
+      z.avail_in = more ? uInt(in.size()) : 0;
+      int flush = more ? Z_NO_FLUSH : Z_FINISH;
+      int ret;
+      do {
+        z.next_out = reinterpret_cast<Bytef*>(out.data());
+        z.avail_out = uInt(out.size());
+        ret = deflate(&z, flush);
+        if (ret == Z_STREAM_ERROR) {
+          fail("gzip compression failed");
+          break;
+        }
+        if (!write_out(out.data(), out.size() - z.avail_out)) break;
+      } while (z.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+      if (!error.empty()) break;
+    }
+    deflateEnd(&z);
+  }
+
+  void encode_zstd() {
+    auto api = get_zstd_api();
+    auto cctx = api->create_cctx();
+    std::string in;
+    std::vector<char> out(compression_chunk_size);
+    for (bool more = true; more && error.empty();) {
+      more = queue.pop(in);
+      ZstdInBuffer input = {in.data(), more ? in.size() : 0, 0};
+      int mode = more ? ZSTD_CONTINUE : ZSTD_END;
+      size_t remaining;
+      do {
+        ZstdOutBuffer output = {out.data(), out.size(), 0};
+        remaining = api->compress_stream2(cctx, &output, &input, mode);
+        if (api->is_error(remaining)) {
+          fail(api->get_error_name(remaining));
+          break;
+        }
+        if (!write_out(out.data(), output.pos)) break;
+      } while (mode == ZSTD_END ? remaining != 0 : input.pos < input.size);
+    }
+    api->free_cctx(cctx);
+  }
+
+  void encode() {
+    if (compression == COMPRESSION_GZIP) encode_gzip();
+    else encode_zstd();
+  }
+
+  void hand_over() {
+    chunk.resize(size_t(pptr() - pbase()));
+    if (!chunk.empty()) queue.push(std::move(chunk));
+    chunk.assign(compression_chunk_size, '\0');
+    setp(&chunk[0], &chunk[0] + chunk.size());
+  }
+
+protected:
+
+  int_type overflow(int_type c) override {
+    hand_over();
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+  }
+
+public:
+
+  CompressingBuf(int f, Compression c):fd(f),compression(c),queue(4),
+    chunk(compression_chunk_size, '\0') {
+    setp(&chunk[0], &chunk[0] + chunk.size());
+    thread = std::thread(&CompressingBuf::encode, this);
+  }
+
+  ~CompressingBuf() { finish(); }
+
+  /* compresses what is left, false if any of it
+     could not be written */
+  bool finish() {
+    if (thread.joinable()) {
+      hand_over();
+      queue.close();
+      thread.join();
+    }
+    return error.empty();
+  }
+};
+
+/* a file to parse, decompressed on a separate
+   thread if it is a gzip or zstd file */
+class InputFile {
+  std::ifstream file;
+  std::unique_ptr<DecompressingBuf> buf;
+  std::unique_ptr<std::istream> stream;
+  Compression compression;
+
+public:
+
+  InputFile():compression(COMPRESSION_NONE) {}
+
+  bool open(std::string const& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    unsigned char magic[4];
+    compression = compression_of_magic(magic, ::pread(fd, magic, sizeof(magic), 0));
+    if (compression == COMPRESSION_ZSTD && !get_zstd_api()) {
+      std::cout << path << " is zstd-compressed, which needs libzstd.so.1\n";
+      ::close(fd);
+      return false;
+    }
+    if (compression == COMPRESSION_NONE) {
+      ::close(fd);
+      file.open(path);
+      return file.is_open();
+    }
+    buf.reset(new DecompressingBuf(fd, compression, path));
+    stream.reset(new std::istream(buf.get()));
+    stream->exceptions(std::ios::badbit);
+    return true;
+  }
+
+  std::istream& get() {
+    if (stream) return *stream;
+    return file;
+  }
+
+  Compression get_compression() const { return compression; }
+};
+
+/* an output file that only replaces path once commit()
+   succeeds, so a failed run leaves the previous output alone.
+   devices and pipes are written directly. */
+class OutputFile {
+  std::string path;
+  std::string target;
+  std::string tmp_path;
+  std::ofstream stream;
+  int fd;
+  std::unique_ptr<CompressingBuf> compressor;
+  std::unique_ptr<std::ostream> compressed;
+
+public:
+
+  OutputFile():fd(-1) {}
+
+  ~OutputFile() {
+    compressed.reset();
+    compressor.reset();
+    if (fd != -1) ::close(fd);
+    if (!tmp_path.empty()) ::unlink(tmp_path.c_str());
+  }
+
+  /* compressed according to the suffix of p */
+  bool open(std::string const& p) {
+    return open(p, compression_of_path(p));
+  }
+
+  bool open(std::string const& p, Compression compression) {
+    path = p;
+    if (compression == COMPRESSION_ZSTD && !get_zstd_api()) {
+      std::cout << "writing " << path << " with zstd needs libzstd.so.1\n";
+      return false;
+    }
+    target = write_target(path);
+    struct stat st;
+    bool exists = ::stat(target.c_str(), &st) == 0;
+    if (exists && !S_ISREG(st.st_mode)) {
+      if (compression == COMPRESSION_NONE) stream.open(path);
+      else fd = ::open(path.c_str(), O_WRONLY | O_TRUNC);
+    } else {
+      auto tmp = target + ".XXXXXX";
+      std::vector<char> name(tmp.begin(), tmp.end());
+      name.push_back('\0');
+      fd = ::mkstemp(name.data());
+      if (fd >= 0) {
+        mode_t mode;
+        if (exists) {
+          mode = st.st_mode & 07777;
+        } else {
+          mode = ::umask(0);
+          ::umask(mode);
+          mode = 0666 & ~mode;
+        }
+        ::fchmod(fd, mode);
+        tmp_path = name.data();
+        if (compression == COMPRESSION_NONE) {
+          ::close(fd);
+          fd = -1;
+          stream.open(tmp_path);
+        }
+      }
+    }
+    if (fd >= 0) {
+      compressor.reset(new CompressingBuf(fd, compression));
+      compressed.reset(new std::ostream(compressor.get()));
+    }
+    if (!compressed && !stream.is_open()) {
+      std::cout << "could not open " << path << " for writing\n";
+      return false;
+    }
+    return true;
+  }
+
+  std::ostream& get() {
+    if (compressed) return *compressed;
+    return stream;
+  }
+
+  bool commit() {
+    bool ok;
+    if (compressor) {
+      ok = compressed->good() && compressor->finish();
+      ok = ::close(fd) == 0 && ok;
+      fd = -1;
+    } else {
+      stream.close();
+      ok = !stream.fail();
+    }
+    if (ok && !tmp_path.empty()) ok = ::rename(tmp_path.c_str(), target.c_str()) == 0;
+    if (!ok) {
+      std::cout << "could not write " << path << "\n";
+      return false;
+    }
+    tmp_path.clear();
+    return true;
+  }
+};
+
+/* fixrefs --build-doi-index works.jsonl doi.index
+   indexes a local dump of Crossref metadata, one work per
+   line as the Crossref API returns it (optionally wrapped in
+   its {"message":...} envelope), by DOI.
+   fixrefs --doi-index doi.index ... then fills the volume,
+   number, pages, year, month, day and journal or booktitle
+   an entry lacks from the work with the same doi, and warns
+   when the numbers it already has disagree with Crossref.
+   Entries with a crossref get their booktitle and date from
+   the parent, so only the other fields are filled for them.
+
+   The index is a hash table built to be used straight from
+   mmap, so opening it costs nothing and each lookup touches
+   a slot and a record:
+     DoiIndexHeader
+     records, each "doi\0name\0value\0...name\0value\0\0"
+     nslots DoiSlots, open addressing with linear probing
+   Integers are in the byte order of the machine that built it.
+ */
+
+/* the doi without the resolver URL some exports put in front */
+static std::string doi_of(Entry const& entry) {
+  auto it = find_field(entry, "doi");
+  if (it == entry.fields.end()) return std::string();
+  auto doi = as_lowercase(it->value);
+  static char const* const prefixes[] = {
+    "https://doi.org/",
+    "http://doi.org/",
+    "https://dx.doi.org/",
+    "http://dx.doi.org/",
+    "doi:"
+  };
+  for (size_t i = 0; i < ARRAY_SIZE(prefixes); ++i) {
+    std::string prefix(prefixes[i]);
+    if (doi.compare(0, prefix.size(), prefix) == 0) {
+      doi.erase(0, prefix.size());
+      break;
+    }
+  }
+  return doi;
+}
+
+/* just enough JSON to pull fields out of one line,
+   throwing ParseError on anything malformed */
+class JsonReader {
+  char const* p;
+  char const* end;
+
+  void fail(char const* what) {
+    throw ParseError(std::string("invalid JSON: ") + what + "\n");
+  }
+
+  void put_utf8(std::string& s, unsigned long c) {
+    if (c < 0x80) {
+      s.push_back(char(c));
+    } else if (c < 0x800) {
+      s.push_back(char(0xC0 | (c >> 6)));
+      s.push_back(char(0x80 | (c & 0x3F)));
+    } else if (c < 0x10000) {
+      s.push_back(char(0xE0 | (c >> 12)));
+      s.push_back(char(0x80 | ((c >> 6) & 0x3F)));
+      s.push_back(char(0x80 | (c & 0x3F)));
+    } else {
+      s.push_back(char(0xF0 | (c >> 18)));
+      s.push_back(char(0x80 | ((c >> 12) & 0x3F)));
+      s.push_back(char(0x80 | ((c >> 6) & 0x3F)));
+      s.push_back(char(0x80 | (c & 0x3F)));
+    }
+  }
+
+  unsigned long read_hex4() {
+    if (end - p < 4) fail("truncated \\u escape");
+    unsigned long c = 0;
+    for (int i = 0; i < 4; ++i, ++p) {
+      c <<= 4;
+      if (*p >= '0' && *p <= '9') c |= unsigned(*p - '0');
+      else if (*p >= 'a' && *p <= 'f') c |= unsigned(*p - 'a' + 10);
+      else if (*p >= 'A' && *p <= 'F') c |= unsigned(*p - 'A' + 10);
+      else fail("bad \\u escape");
+    }
+    return c;
+  }
+
+  /* a number, true, false or null */
+  std::string read_literal() {
+    auto b = p;
+    while (p != end && (std::isalnum(*p) || *p == '-' || *p == '+' || *p == '.')) ++p;
+    if (p == b) fail("unexpected character");
+    return std::string(b, p);
+  }
+
+public:
+
+  JsonReader(std::string const& s):p(s.data()),end(s.data() + s.size()) {}
+
+  char peek() {
+    while (p != end && std::isspace(*p)) ++p;
+    if (p == end) fail("unexpected end of line");
+    return *p;
+  }
+
+  void expect(char c) {
+    if (peek() != c) fail("unexpected character");
+    ++p;
+  }
+
+  std::string read_string() {
+    expect('"');
+    std::string s;
+    while (true) {
+      if (p == end) fail("unterminated string");
+      char c = *p++;
+      if (c == '"') return s;
+      if (c != '\\') {
+        s.push_back(c);
+        continue;
+      }
+      if (p == end) fail("unterminated string");
+      c = *p++;
+      switch (c) {
+        case 'b': s.push_back('\b'); break;
+        case 'f': s.push_back('\f'); break;
+        case 'n': s.push_back('\n'); break;
+        case 'r': s.push_back('\r'); break;
+        case 't': s.push_back('\t'); break;
+        case 'u': {
+          auto u = read_hex4();
+          if (u >= 0xD800 && u < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u') {
+            p += 2;
+            auto low = read_hex4();
+            u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+          }
+          put_utf8(s, u);
+          break;
+        }
+        default: s.push_back(c);
+      }
+    }
+  }
+
+  /* a string, or the text of a number */
+  std::string read_text() {
+    if (peek() == '"') return read_string();
+    return read_literal();
+  }
+
+  template <typename F>
+  void read_object(F f) {
+    expect('{');
+    if (peek() == '}') {
+      ++p;
+      return;
+    }
+    while (true) {
+      auto name = read_string();
+      expect(':');
+      f(name);
+      if (peek() != ',') break;
+      ++p;
+    }
+    expect('}');
+  }
+
+  template <typename F>
+  void read_array(F f) {
+    expect('[');
+    if (peek() == ']') {
+      ++p;
+      return;
+    }
+    while (true) {
+      f();
+      if (peek() != ',') break;
+      ++p;
+    }
+    expect(']');
+  }
+
+  void skip() {
+    switch (peek()) {
+      case '{': read_object([this](std::string const&) { skip(); }); break;
+      case '[': read_array([this]() { skip(); }); break;
+      case '"': read_string(); break;
+      default: read_literal();
+    }
+  }
+};
+
+struct CrossrefWork {
+  std::string doi;
+  Fields fields;
+};
+
+static void add_field(Fields& fields, std::string const& name, std::string const& value) {
+  if (value.empty()) return;
+  Field field;
+  field.name = name;
+  field.value = value;
+  fields.push_back(field);
+}
+
+/* reads {"date-parts":[[year,month,day]]} */
+static std::vector<long> read_crossref_date(JsonReader& json) {
+  std::vector<long> parts;
+  json.read_object([&](std::string const& name) {
+    if (name != "date-parts") {
+      json.skip();
+      return;
+    }
+    json.read_array([&]() {
+      json.read_array([&]() {
+        auto text = json.read_text();
+        if (parts.size() < 3 && std::isdigit(text[0])) parts.push_back(std::atol(text.c_str()));
+      });
+    });
+  });
+  return parts;
+}
+
+static void read_crossref_work(JsonReader& json, CrossrefWork& work) {
+  /* printed, then issued, then online */
+  std::vector<long> dates[3];
+  json.read_object([&](std::string const& name) {
+    if (name == "message") {
+      read_crossref_work(json, work);
+    } else if (name == "DOI") {
+      work.doi = as_lowercase(json.read_string());
+    } else if (name == "volume") {
+      add_field(work.fields, "volume", json.read_text());
+    } else if (name == "issue") {
+      add_field(work.fields, "number", json.read_text());
+    } else if (name == "page") {
+      add_field(work.fields, "pages", json.read_text());
+    } else if (name == "publisher") {
+      add_field(work.fields, "publisher", json.read_text());
+    } else if (name == "container-title") {
+      std::string title;
+      if (json.peek() == '[') {
+        json.read_array([&]() {
+          auto s = json.read_text();
+          if (title.empty()) title = s;
+        });
+      } else {
+        title = json.read_text();
+      }
+      add_field(work.fields, "container", title);
+    } else if (name == "published-print") {
+      dates[0] = read_crossref_date(json);
+    } else if (name == "issued") {
+      dates[1] = read_crossref_date(json);
+    } else if (name == "published-online") {
+      dates[2] = read_crossref_date(json);
+    } else {
+      json.skip();
+    }
+  });
+  for (auto const& date : dates) {
+    if (date.empty()) continue;
+    static char const* const parts[] = {"year", "month", "day"};
+    for (size_t i = 0; i < date.size(); ++i)
+      add_field(work.fields, parts[i], std::to_string(date[i]));
+    break;
+  }
+}
+
+struct DoiIndexHeader {
+  char magic[8];
+  uint64_t nrecords;
+  uint64_t nslots;
+  uint64_t slots_offset;
+};
+
+struct DoiSlot {
+  uint64_t hash;
+  /* of the record, 0 for an empty slot */
+  uint64_t offset;
+};
+
+static char const doi_index_magic[8] = {'F', 'X', 'D', 'O', 'I', 'X', '0', '1'};
+
+/* 64-bit FNV-1a */
+static uint64_t hash_doi(std::string const& doi) {
+  uint64_t h = 14695981039346656037ULL;
+  for (auto c : doi) {
+    h ^= (unsigned char)c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static bool build_doi_index(std::string const& inpath, std::string const& outpath) {
+  InputFile in;
+  if (!in.open(inpath)) {
+    std::cout << "could not open " << inpath << " for reading\n";
+    return false;
+  }
+  OutputFile out;
+  if (!out.open(outpath, COMPRESSION_NONE)) return false;
+  auto& stream = out.get();
+  DoiIndexHeader header;
+  std::memset(&header, 0, sizeof(header));
+  stream.write(reinterpret_cast<char const*>(&header), sizeof(header));
+  uint64_t offset = sizeof(header);
+  std::vector<DoiSlot> records;
+  /* of each record, to tell DOIs whose hashes collide apart */
+  StringVector dois;
+  std::string line;
+  std::string record;
+  size_t lineno = 0;
+  size_t nbad = 0;
+  while (true) {
+    try {
+      if (!std::getline(in.get(), line)) break;
+    } catch (ParseError const& e) {
+      std::cout << e.what();
+      return false;
+    }
+    ++lineno;
+    if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+    CrossrefWork work;
+    try {
+      JsonReader json(line);
+      read_crossref_work(json, work);
+    } catch (ParseError const& e) {
+      if (nbad++ < 10) std::cout << inpath << ":" << lineno << ": " << e.what();
+      continue;
+    }
+    if (work.doi.empty()) continue;
+    record = work.doi;
+    record.push_back('\0');
+    for (auto const& field : work.fields) {
+      record += field.name;
+      record.push_back('\0');
+      record += field.value;
+      record.push_back('\0');
+    }
+    record.push_back('\0');
+    stream.write(record.data(), std::streamsize(record.size()));
+    DoiSlot slot;
+    slot.hash = hash_doi(work.doi);
+    slot.offset = offset;
+    records.push_back(slot);
+    dois.push_back(work.doi);
+    offset += record.size();
+  }
+  if (nbad) std::cout << nbad << " lines of " << inpath << " were not valid JSON\n";
+  uint64_t nslots = 16;
+  while (nslots < 2 * records.size()) nslots *= 2;
+  std::vector<DoiSlot> slots(nslots, DoiSlot());
+  /* the record in each slot */
+  std::vector<size_t> owners(nslots);
+  for (size_t r = 0; r < records.size(); ++r) {
+    auto const& record_slot = records[r];
+    auto i = record_slot.hash & (nslots - 1);
+    while (slots[i].offset && (slots[i].hash != record_slot.hash ||
+                               dois[owners[i]] != dois[r]))
+      i = (i + 1) & (nslots - 1);
+    /* later works with the same doi replace earlier ones */
+    if (!slots[i].offset) ++header.nrecords;
+    slots[i] = record_slot;
+    owners[i] = r;
+  }
+  while (offset % 8) {
+    stream.put('\0');
+    ++offset;
+  }
+  std::memcpy(header.magic, doi_index_magic, sizeof(header.magic));
+  header.nslots = nslots;
+  header.slots_offset = offset;
+  stream.write(reinterpret_cast<char const*>(slots.data()),
+      std::streamsize(slots.size() * sizeof(DoiSlot)));
+  stream.seekp(0);
+  stream.write(reinterpret_cast<char const*>(&header), sizeof(header));
+  if (!out.commit()) return false;
+  std::cout << "indexed " << header.nrecords << " DOIs\n";
+  return true;
+}
+
+/* a read-only mapping of an index built by build_doi_index,
+   safe to share between threads */
+class DoiIndex {
+  int fd;
+  char const* data;
+  size_t size;
+  DoiIndexHeader header;
+
+  DoiIndex(DoiIndex const&) = delete;
+  DoiIndex& operator=(DoiIndex const&) = delete;
+
+  DoiSlot const* slots() const {
+    return reinterpret_cast<DoiSlot const*>(data + header.slots_offset);
+  }
+
+  /* the NUL-terminated string at p, or false if it runs past end */
+  static bool next_string(char const*& p, char const* end, std::string& s) {
+    auto nul = static_cast<char const*>(std::memchr(p, '\0', size_t(end - p)));
+    if (!nul) return false;
+    s.assign(p, nul);
+    p = nul + 1;
+    return true;
+  }
+
+public:
+
+  DoiIndex():fd(-1),data(nullptr),size(0) {}
+
+  ~DoiIndex() {
+    if (data) ::munmap(const_cast<char*>(data), size);
+    if (fd != -1) ::close(fd);
+  }
+
+  bool open(std::string const& path) {
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || ::fstat(fd, &st) != 0) {
+      std::cout << "could not open " << path << " for reading\n";
+      return false;
+    }
+    size = size_t(st.st_size);
+    if (size >= sizeof(header)) {
+      void* p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p != MAP_FAILED) {
+        data = static_cast<char const*>(p);
+        ::madvise(p, size, MADV_RANDOM);
+        std::memcpy(&header, data, sizeof(header));
+      }
+    }
+    if (!data ||
+        std::memcmp(header.magic, doi_index_magic, sizeof(header.magic)) != 0 ||
+        header.nslots == 0 || (header.nslots & (header.nslots - 1)) != 0 ||
+        header.slots_offset % 8 != 0 || header.slots_offset > size ||
+        (size - header.slots_offset) / sizeof(DoiSlot) < header.nslots) {
+      std::cout << path << " is not a DOI index built by --build-doi-index\n";
+      return false;
+    }
+    return true;
+  }
+
+  /* the fields Crossref has for doi, or false */
+  bool find(std::string const& doi, Fields& fields) const {
+    auto hash = hash_doi(doi);
+    auto mask = header.nslots - 1;
+    auto end = data + header.slots_offset;
+    std::string s;
+    /* a damaged index may have no empty slot to stop at */
+    auto i = hash & mask;
+    for (uint64_t probes = 0; probes < header.nslots; ++probes, i = (i + 1) & mask) {
+      auto const& slot = slots()[i];
+      if (!slot.offset || slot.offset >= header.slots_offset) return false;
+      if (slot.hash != hash) continue;
+      auto p = data + slot.offset;
+      if (!next_string(p, end, s) || s != doi) continue;
+      fields.clear();
+      Field field;
+      while (next_string(p, end, field.name) && !field.name.empty() &&
+             next_string(p, end, field.value))
+        fields.push_back(field);
+      return true;
+    }
+    return false;
+  }
+};
+
+/* the entry field Crossref's container-title goes in */
+static char const* container_field(std::string const& type) {
+  if (type == "article") return "journal";
+  if (type == "inproceedings" || type == "incollection" || type == "inbook") return "booktitle";
+  return nullptr;
+}
+
+/* braces, spaces and doubled dashes aside */
+static std::string comparable_value(std::string const& name, std::string const& value) {
+  if (name == "month") {
+    int month = month_number(value);
+    if (!month) month = std::atoi(value.c_str());
+    return std::to_string(month);
+  }
+  std::string s;
+  for (auto c : value) {
+    if (c == '{' || c == '}' || std::isspace(c)) continue;
+    if (c == '-' && !s.empty() && s.back() == '-') continue;
+    s.push_back(std::tolower(c));
+  }
+  return s;
+}
+
+static void enrich_from_doi_index(std::ostream& log, Entries& entries, DoiIndex const& index) {
+  static StringSet const checked = {"volume", "number", "pages", "year", "month", "day"};
+  static StringSet const from_parent = {"booktitle", "year", "month", "day", "publisher"};
+  Fields found;
+  for (auto& entry : entries) {
+    auto doi = doi_of(entry);
+    if (doi.empty() || !index.find(doi, found)) continue;
+    auto const& required = get_required_fields(entry.type);
+    bool has_parent = has_field(entry, "crossref");
+    for (auto& field : found) {
+      if (field.name == "container") {
+        auto name = container_field(entry.type);
+        if (!name) continue;
+        field.name = name;
+      } else if (std::find(required.begin(), required.end(), field.name) == required.end()) {
+        continue;
+      }
+      if (field.name == "month") {
+        auto month = std::atoi(field.value.c_str());
+        if (month < 1 || month > 12) continue;
+        field.value = month_names[month - 1];
+      }
+      auto it = find_field(entry, field.name);
+      if (it == entry.fields.end()) {
+        if (has_parent && from_parent.count(field.name)) continue;
+        log << entry.key << " " << field.name << " filled in from " << doi << "\n";
+        entry.fields.push_back(field);
+        entry.modified = true;
+      } else if (checked.count(field.name) &&
+                 comparable_value(field.name, it->value) !=
+                 comparable_value(field.name, field.value)) {
+        log << "WARNING: " << entry.key << " " << field.name << " is \"" << it->value
+          << "\" but " << doi << " has \"" << field.value << "\"\n";
+      }
+    }
+  }
+}
+
+/* with --strings expand every value still written as an
+   expression uses a macro that was never defined (or was
+   defined from one that was not). month macros are left
+   to the style on purpose and not reported. */
+static void warn_undefined_macros(std::ostream& log, Entries const& entries) {
+  MacroTable none;
+  std::string text;
+  std::string rest;
+  StringVector names;
+  for (auto const& entry : entries) {
+    if (entry.type == "comment" || entry.type == "preamble") continue;
+    for (auto const& field : entry.fields) {
+      if (field.limit != FVL_NONE) continue;
+      if (!none.expand(field, text, rest, names)) continue;
+      for (auto const& name : names) {
+        if (name.size() == 3 && month_number(name)) continue;
+        log << "WARNING: " << entry.key << " " << field.name
+          << " uses undefined macro " << name << "\n";
+      }
+    }
+  }
+}
+
+enum OutputFormat {
+  FORMAT_BIBTEX,
+  FORMAT_JSON_LINES,
+  FORMAT_CSL_JSON
+};
+
+static bool parse_output_format(std::string const& name, OutputFormat& format) {
+  if (name == "bibtex") format = FORMAT_BIBTEX;
+  else if (name == "jsonl") format = FORMAT_JSON_LINES;
+  else if (name == "csl-json") format = FORMAT_CSL_JSON;
+  else return false;
+  return true;
+}
+
+struct FixOptions {
+  FixOptions():strings(STRINGS_KEEP),author_style(AUTHORS_KEEP),doi_index(nullptr),
+    format(FORMAT_BIBTEX) {}
+  /* given to the Parser, which expands macros as it reads */
+  StringMacros strings;
+  AuthorStyle author_style;
+  DoiIndex const* doi_index;
+  /* what the entries will be written as */
+  OutputFormat format;
+};
+
+/* the passes that rewrite entries, in the order
+   they have always been applied */
+static void fix_entries(std::ostream& log, Entries& entries, FixOptions const& options) {
+  if (options.strings == STRINGS_EXPAND) warn_undefined_macros(log, entries);
+  conference_to_inproceedings(entries);
+  remove_unwanted_fields(entries);
+  if (options.doi_index) enrich_from_doi_index(log, entries, *options.doi_index);
+  /* JSON has no comments to keep the url in */
+  if (options.format == FORMAT_BIBTEX) comment_out_urls(entries);
+  abbreviate(entries);
+  escape_ampersand(entries);
+  fix_months(entries);
+  unify_dashes(log, entries);
+  fix_author_lists(log, entries, options.author_style);
+  type_fields(log, entries);
+}
+
+/* fixrefs --query --where TERM... input.bib [output]
+   prints the entries matching every TERM, as normalized
+   BibTeX or in the --format given. TERM is one of
+     has=FIELD  missing=FIELD
+     year=2015  year=2010-2015  year>=2015  year<2020 ...
+     NAME=VALUE  exact value, ignoring case
+     NAME~GLOB   shell-style pattern, ignoring case
+   where NAME is a field, key, type, author (a name in the
+   author list, only the last name if no first name is given)
+   or venue (journal or booktitle).
+   Indexes on type, year, venue, author and whatever else the
+   terms need are built the first time they are used, and each
+   term becomes a bitset over the entries that are intersected.
+ */
+
+class Bitset {
+  std::vector<uint64_t> words;
+
+public:
+
+  Bitset(size_t n):words((n + 63) / 64, 0) {}
+
+  void set(size_t i) { words[i / 64] |= uint64_t(1) << (i % 64); }
+
+  void set(std::vector<uint32_t> const& positions) {
+    for (auto i : positions) set(i);
+  }
+
+  void intersect(Bitset const& other) {
+    for (size_t i = 0; i < words.size(); ++i) words[i] &= other.words[i];
+  }
+
+  void subtract(Bitset const& other) {
+    for (size_t i = 0; i < words.size(); ++i) words[i] &= ~other.words[i];
+  }
+
+  template <typename F>
+  void for_each(F f) const {
+    for (size_t i = 0; i < words.size(); ++i)
+      for (auto w = words[i]; w; w &= w - 1)
+        f(i * 64 + size_t(__builtin_ctzll(w)));
+  }
+};
+
+using Postings = std::vector<uint32_t>;
+
+enum QueryOp {
+  QUERY_HAS,
+  QUERY_MISSING,
+  QUERY_YEARS,
+  QUERY_EQUAL,
+  QUERY_MATCH
+};
+
+struct QueryTerm {
+  QueryOp op;
+  std::string name;
+  std::string value;
+  int first_year;
+  int last_year;
+};
+
+using Query = std::vector<QueryTerm>;
+
+static bool parse_year(std::string const& s, int& year) {
+  auto b = std::find_if(begin(s), end(s), ::isdigit);
+  if (b == end(s)) return false;
+  year = std::atoi(&*b);
+  return true;
+}
+
+static bool parse_query_term(std::string const& s, QueryTerm& term) {
+  auto op_begin = s.find_first_of("=~<>");
+  if (op_begin == 0 || op_begin == std::string::npos) return false;
+  auto op_end = s.find_first_not_of("=~<>", op_begin);
+  if (op_end == std::string::npos) return false;
+  auto op = s.substr(op_begin, op_end - op_begin);
+  term.name = as_lowercase(s.substr(0, op_begin));
+  term.value = s.substr(op_end);
+  if (term.name == "has" || term.name == "missing") {
+    if (op != "=") return false;
+    term.op = term.name == "has" ? QUERY_HAS : QUERY_MISSING;
+    term.name = as_lowercase(term.value);
+    return true;
+  }
+  if (term.name == "year") {
+    int a, b;
+    auto dash = term.value.find('-');
+    if (!parse_year(term.value.substr(0, dash), a)) return false;
+    b = a;
+    if (dash != std::string::npos && !parse_year(term.value.substr(dash + 1), b))
+      return false;
+    term.op = QUERY_YEARS;
+    term.first_year = INT_MIN;
+    term.last_year = INT_MAX;
+    if (op == "=") { term.first_year = a; term.last_year = b; }
+    else if (op == ">=") term.first_year = a;
+    else if (op == ">") term.first_year = a + 1;
+    else if (op == "<=") term.last_year = a;
+    else if (op == "<") term.last_year = a - 1;
+    else return false;
+    return true;
+  }
+  if (op == "=") term.op = QUERY_EQUAL;
+  else if (op == "~") term.op = QUERY_MATCH;
+  else return false;
+  return true;
+}
+
+/* what a query term NAME refers to in an entry, or null */
+static std::string const* query_value(Entry const& entry, std::string const& name) {
+  if (name == "key") return &entry.key;
+  if (name == "type") return &entry.type;
+  auto it = find_field(entry, name);
+  if (it == entry.fields.end() && name == "venue") {
+    it = find_field(entry, "journal");
+    if (it == entry.fields.end()) it = find_field(entry, "booktitle");
+  }
+  if (it == entry.fields.end()) return nullptr;
+  return &it->value;
+}
+
+static bool is_queryable(Entry const& entry) {
+  return entry.type != "comment" && entry.type != "string" && entry.type != "preamble";
+}
+
+/* secondary indexes over entries, each built the first time
+   a term needs it. the author index comes from the
+   ids fix_author_lists left in the entries. */
+class QueryIndex {
+  Entries& entries;
+  std::mutex mutex;
+  Postings all;
+  std::unordered_map<std::string, Postings> present;
+  std::map<int, Postings> years;
+  std::map<std::string, std::unordered_map<std::string, Postings>> values;
+  bool authors_built;
+  AuthorIndex author_index;
+
+  void build_present() {
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (!is_queryable(entries[i])) continue;
+      all.push_back(uint32_t(i));
+      for (auto const& field : entries[i].fields) {
+        auto& postings = present[field.name];
+        if (postings.empty() || postings.back() != i) postings.push_back(uint32_t(i));
+      }
+    }
+  }
+
+  void build_years() {
+    for (auto i : all) {
+      auto it = find_field(entries[i], "year");
+      int year;
+      if (it != entries[i].fields.end() && field_number(*it, year))
+        years[year].push_back(i);
+    }
+  }
+
+  std::unordered_map<std::string, Postings>& get_values(std::string const& name) {
+    auto it = values.find(name);
+    if (it != values.end()) return it->second;
+    auto& index = values[name];
+    for (auto i : all) {
+      auto value = query_value(entries[i], name);
+      if (value) index[as_lowercase(*value)].push_back(i);
+    }
+    return index;
+  }
+
+  Bitset select_term(QueryTerm const& term) {
+    Bitset bits(entries.size());
+    if (term.op == QUERY_HAS || term.op == QUERY_MISSING) {
+      auto it = present.find(term.name);
+      if (it != present.end()) bits.set(it->second);
+      if (term.op == QUERY_MISSING) {
+        Bitset missing(entries.size());
+        missing.set(all);
+        missing.subtract(bits);
+        return missing;
+      }
+    } else if (term.op == QUERY_YEARS) {
+      if (years.empty()) build_years();
+      for (auto it = years.lower_bound(term.first_year);
+           it != years.end() && it->first <= term.last_year; ++it)
+        bits.set(it->second);
+    } else if (term.op == QUERY_EQUAL && term.name == "author") {
+      if (!authors_built) {
+        author_index = build_author_index(entries);
+        authors_built = true;
+      }
+      for (auto id : get_author_table().find(parse_person(term.value)))
+        if (id < author_index.size()) bits.set(author_index[id]);
+    } else if (term.op == QUERY_EQUAL) {
+      auto& index = get_values(term.name);
+      auto it = index.find(as_lowercase(term.value));
+      if (it != index.end()) bits.set(it->second);
+    } else {
+      for (auto i : all) {
+        auto value = query_value(entries[i], term.name);
+        if (value && ::fnmatch(term.value.c_str(), value->c_str(), FNM_CASEFOLD) == 0)
+          bits.set(i);
+      }
+    }
+    return bits;
+  }
+
+public:
+
+  QueryIndex(Entries& e):entries(e),authors_built(false) {
+    build_present();
+  }
+
+  /* positions of the entries matching every term, in order */
+  Postings select(Query const& query) {
+    std::lock_guard<std::mutex> guard(mutex);
+    Bitset bits(entries.size());
+    bits.set(all);
+    for (auto const& term : query) bits.intersect(select_term(term));
+    Postings found;
+    bits.for_each([&](size_t i) { found.push_back(uint32_t(i)); });
+    return found;
+  }
+};
+
+/* Output formats, selected with --format:
+     bibtex     what print_entry writes (default)
+     jsonl      one JSON object per entry and line:
+                {"key":...,"type":...,"fields":{"author":...,...}}
+     csl-json   an array of CSL-JSON items, as read by
+                citeproc-based tools
+   Comments, @string and @preamble only exist in BibTeX.
+   Entries are written one at a time as they are produced.
+ */
+
+/* writes JSON through a fixed buffer, escaping strings
+   as it copies them rather than building temporaries,
+   and placing the commas between members itself */
+class JsonWriter {
+  std::ostream& stream;
+  char buf[1 << 14];
+  size_t size;
+  bool first[8];
+  int depth;
+  bool separated;
+
+  void put(char c) {
+    if (size == sizeof(buf)) flush();
+    buf[size++] = c;
+  }
+
+  void put(char const* s) {
+    while (*s) put(*s++);
+  }
+
+  void separate() {
+    if (separated) {
+      separated = false;
+      return;
+    }
+    if (depth == 0) return;
+    if (!first[depth - 1]) put(',');
+    first[depth - 1] = false;
+  }
+
+public:
+
+  JsonWriter(std::ostream& s):stream(s),size(0),depth(0),separated(false) {}
+  ~JsonWriter() { flush(); }
+
+  void flush() {
+    stream.write(buf, std::streamsize(size));
+    size = 0;
+  }
+
+  void open(char c) {
+    assert(depth < int(ARRAY_SIZE(first)));
+    separate();
+    put(c);
+    first[depth++] = true;
+  }
+
+  void close(char c) {
+    --depth;
+    put(c);
+  }
+
+  void newline() { put('\n'); }
+
+  /* the separator before the next value, then a newline */
+  void next_line() {
+    separate();
+    put('\n');
+    separated = true;
+  }
+
+  void name(char const* n) {
+    separate();
+    put('"');
+    put(n);
+    put("\":");
+    separated = true;
+  }
+
+  void name(std::string const& n) {
+    separate();
+    put_string(n, false);
+    put(':');
+    separated = true;
+  }
+
+  /* braces only group text for BibTeX, so
+     strip_braces leaves them out */
+  void value(std::string const& s, bool strip_braces = false) {
+    separate();
+    put_string(s, strip_braces);
+  }
+
+  void value(long n) {
+    separate();
+    char digits[24];
+    std::snprintf(digits, sizeof(digits), "%ld", n);
+    put(digits);
+  }
+
+private:
+
+  void put_string(std::string const& s, bool strip_braces) {
+    put('"');
+    for (auto c : s) {
+      switch (c) {
+        case '"': put("\\\""); break;
+        case '\\': put("\\\\"); break;
+        case '\n': put("\\n"); break;
+        case '\t': put("\\t"); break;
+        case '{':
+        case '}':
+          if (!strip_braces) put(c);
+          break;
+        default:
+          if ((unsigned char)c < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", unsigned(c));
+            put(code);
+          } else {
+            put(c);
+          }
+      }
+    }
+    put('"');
+  }
+};
+
+static char const* csl_type(std::string const& type) {
+  static std::map<std::string, char const*> const types = {
+    {"article", "article-journal"},
+    {"inproceedings", "paper-conference"},
+    {"proceedings", "book"},
+    {"book", "book"},
+    {"inbook", "chapter"},
+    {"incollection", "chapter"},
+    {"techreport", "report"},
+    {"phdthesis", "thesis"},
+    {"mastersthesis", "thesis"},
+    {"electronic", "webpage"},
+    {"website", "webpage"},
+    {"blog", "post-weblog"},
+    {"manual", "book"},
+    {"electronicmanual", "book"}
+  };
+  auto it = types.find(type);
+  if (it == types.end()) return "document";
+  return it->second;
+}
+
+/* BibTeX fields with a direct CSL-JSON counterpart */
+static char const* csl_variable(std::string const& type, std::string const& field_name) {
+  static std::map<std::string, char const*> const variables = {
+    {"title", "title"},
+    {"journal", "container-title"},
+    {"booktitle", "container-title"},
+    {"series", "collection-title"},
+    {"volume", "volume"},
+    {"pages", "page"},
+    {"edition", "edition"},
+    {"publisher", "publisher"},
+    {"school", "publisher"},
+    {"institution", "publisher"},
+    {"address", "publisher-place"},
+    {"doi", "DOI"},
+    {"url", "URL"},
+    {"isbn", "ISBN"},
+    {"issn", "ISSN"},
+    {"note", "note"}
+  };
+  if (field_name == "number") return type == "article" ? "issue" : "number";
+  auto it = variables.find(field_name);
+  if (it == variables.end()) return nullptr;
+  return it->second;
+}
+
+static void write_csl_names(JsonWriter& json, char const* variable, std::string const& value) {
+  json.name(variable);
+  json.open('[');
+  for (auto const& name : split_authors(value)) {
+    if (name.empty() || name == "others") continue;
+    auto person = parse_person(name);
+    json.open('{');
+    json.name("family");
+    json.value(full_last_name(person), true);
+    if (!person.first.empty()) {
+      json.name("given");
+      json.value(person.first, true);
+    }
+    if (!person.jr.empty()) {
+      json.name("suffix");
+      json.value(person.jr, true);
+    }
+    json.close('}');
+  }
+  json.close(']');
+}
+
+static void write_csl_json(JsonWriter& json, Entry const& entry) {
+  json.open('{');
+  json.name("id");
+  json.value(entry.key);
+  json.name("type");
+  json.value(std::string(csl_type(entry.type)));
+  StringSet written;
+  for (auto const& field : entry.fields) {
+    if (field.name == "author" || field.name == "editor") {
+      write_csl_names(json, field.name.c_str(), field.value);
+      continue;
+    }
+    auto variable = csl_variable(entry.type, field.name);
+    if (!variable || !written.insert(variable).second) continue;
+    json.name(variable);
+    json.value(field.value, true);
+  }
+  int year;
+  auto it = find_field(entry, "year");
+  if (it != entry.fields.end() && field_number(*it, year)) {
+    json.name("issued");
+    json.open('{');
+    json.name("date-parts");
+    json.open('[');
+    json.open('[');
+    json.value(long(year));
+    int month;
+    it = find_field(entry, "month");
+    if (it != entry.fields.end() && field_number(*it, month) && month >= 1 && month <= 12) {
+      json.value(long(month));
+      int day;
+      it = find_field(entry, "day");
+      if (it != entry.fields.end() && field_number(*it, day)) json.value(long(day));
+    }
+    json.close(']');
+    json.close(']');
+    json.close('}');
+  }
+  json.close('}');
+}
+
+static void write_entry_json(JsonWriter& json, Entry const& entry) {
+  json.open('{');
+  json.name("key");
+  json.value(entry.key);
+  json.name("type");
+  json.value(entry.type);
+  json.name("fields");
+  json.open('{');
+  for (auto const& field : entry.fields) {
+    json.name(field.name);
+    json.value(field.value);
+  }
+  json.close('}');
+  json.close('}');
+}
+
+class EntryWriter {
+  std::ostream& stream;
+  OutputFormat format;
+  JsonWriter json;
+  bool started;
+
+public:
+
+  EntryWriter(std::ostream& s, OutputFormat f):stream(s),format(f),json(s),started(false) {}
+
+  void write(Entry const& entry) {
+    if (format == FORMAT_BIBTEX) {
+      print_entry(stream, entry);
+      return;
+    }
+    if (!is_queryable(entry)) return;
+    if (format == FORMAT_JSON_LINES) {
+      write_entry_json(json, entry);
+      json.newline();
+    } else {
+      if (!started) json.open('[');
+      json.next_line();
+      write_csl_json(json, entry);
+    }
+    started = true;
+  }
+
+  void finish() {
+    if (format == FORMAT_CSL_JSON) {
+      if (!started) json.open('[');
+      json.newline();
+      json.close(']');
+      json.newline();
+    }
+    json.flush();
+  }
+};
+
+static void print_selected(std::ostream& stream, Entries const& entries,
+    Postings const& selected, OutputFormat format) {
+  EntryWriter writer(stream, format);
+  for (auto i : selected) writer.write(entries[i]);
+  writer.finish();
+}
+
+/* fixrefs --serve keeps parsed and normalized files
+   resident and answers requests on a Unix domain socket,
+   so that editors and build wrappers calling it many times
+   a minute do not re-parse the same bibliography each time.
+
+   Each connection carries one request: a command line,
+   an optional BibTeX payload, then end of input
+   (e.g. "nc -NU socket").
+   The reply is "ok" or "error" on its own line followed
+   by text, after which the server closes the connection.
+
+     normalize           payload normalized as fixrefs would
+     validate [PATH]     missing field warnings of PATH or payload
+     lookup PATH KEY...  normalized entries of PATH with these keys
+     author PATH NAME    normalized entries of PATH by that author,
+                         anyone with that last name if NAME has no first name
+     query PATH          normalized entries of PATH matching the
+                         --query terms in the payload, one per line
+     reload PATH         re-parse PATH even if it has not changed
+
+   PATH should be absolute, it is resolved by the server.
+   Files are re-parsed whenever their modification time
+   or size changes.
+ */
+
+class ReadLock {
+  pthread_rwlock_t& lock;
+public:
+  ReadLock(pthread_rwlock_t& l):lock(l) { pthread_rwlock_rdlock(&lock); }
+  ~ReadLock() { pthread_rwlock_unlock(&lock); }
+};
+
+class WriteLock {
+  pthread_rwlock_t& lock;
+public:
+  WriteLock(pthread_rwlock_t& l):lock(l) { pthread_rwlock_wrlock(&lock); }
+  ~WriteLock() { pthread_rwlock_unlock(&lock); }
+};
+
+struct LoadedFile {
+  LoadedFile():loaded(false),mtime(),size(0) {
+    pthread_rwlock_init(&lock, nullptr);
+  }
+  ~LoadedFile() { pthread_rwlock_destroy(&lock); }
+  pthread_rwlock_t lock;
+  bool loaded;
+  struct timespec mtime;
+  off_t size;
+  Entries entries;
+  KeyIndex index;
+  std::unique_ptr<QueryIndex> query_index;
+  std::string warnings;
+};
+
+static bool is_current(LoadedFile const& file, struct stat const& st) {
+  return file.loaded &&
+    file.size == st.st_size &&
+    file.mtime.tv_sec == st.st_mtim.tv_sec &&
+    file.mtime.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+static Entries parse_text(std::string const& text, StringMacros strings) {
+  std::stringstream stream(text);
+  Parser parser(strings);
+  parser.run(stream);
+  return parser.get_entries();
+}
+
+class Server {
+  FixOptions options;
+  std::mutex files_mutex;
+  std::map<std::string, std::unique_ptr<LoadedFile>> files;
+  std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+  std::deque<int> queue;
+
+  LoadedFile& get_file(std::string const& path) {
+    std::lock_guard<std::mutex> guard(files_mutex);
+    auto& file = files[path];
+    if (!file) file.reset(new LoadedFile());
+    return *file;
+  }
+
+  void load(LoadedFile& file, std::string const& path,
+      struct stat const& st) {
+    InputFile stream;
+    if (!stream.open(path))
+      throw std::runtime_error("could not open " + path + " for reading\n");
+    Parser parser(options.strings);
+    parser.run(stream.get());
+    std::stringstream log;
+    file.entries.swap(parser.get_entries());
+    fix_entries(log, file.entries, options);
+    warn_missing_fields(log, file.entries);
+    file.warnings = log.str();
+    file.index = build_key_index(file.entries);
+    file.query_index.reset(new QueryIndex(file.entries));
+    file.mtime = st.st_mtim;
+    file.size = st.st_size;
+    file.loaded = true;
+  }
+
+  /* makes sure the resident copy of path matches the disk,
+     callers then take the read lock to use it */
+  LoadedFile& refresh(std::string const& raw_path, bool force) {
+    char resolved[PATH_MAX];
+    if (!realpath(raw_path.c_str(), resolved))
+      throw std::runtime_error("could not resolve " + raw_path + "\n");
+    std::string path(resolved);
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+      throw std::runtime_error("could not stat " + path + "\n");
+    auto& file = get_file(path);
+    if (!force) {
+      ReadLock lock(file.lock);
+      if (is_current(file, st)) return file;
+    }
+    WriteLock lock(file.lock);
+    if (force || !is_current(file, st)) load(file, path, st);
+    return file;
+  }
+
+  std::string handle(std::string const& request) {
+    auto eol = request.find('\n');
+    auto words = split_words(request.substr(0, eol));
+    std::string payload;
+    if (eol != std::string::npos) payload = request.substr(eol + 1);
+    if (words.empty()) throw std::runtime_error("empty request\n");
+    auto const& command = words[0];
+    std::stringstream reply;
+    if (command == "normalize") {
+      auto entries = parse_text(payload, options.strings);
+      std::stringstream log;
+      fix_entries(log, entries, options);
+      print_entries(reply, entries);
+    } else if (command == "validate" && words.size() == 1) {
+      auto entries = parse_text(payload, options.strings);
+      fix_entries(reply, entries, options);
+      warn_missing_fields(reply, entries);
+    } else if (command == "validate" && words.size() == 2) {
+      auto& file = refresh(words[1], false);
+      ReadLock lock(file.lock);
+      reply << file.warnings;
+    } else if (command == "lookup" && words.size() >= 2) {
+      auto& file = refresh(words[1], false);
+      ReadLock lock(file.lock);
+      for (size_t i = 2; i < words.size(); ++i) {
+        auto it = file.index.find(words[i]);
+        if (it == file.index.end())
+          reply << "WARNING: " << words[i] << " not found\n";
+        else
+          print_entry(reply, file.entries[it->second]);
+      }
+    } else if ((command == "author" && words.size() >= 3) ||
+               (command == "query" && words.size() == 2)) {
+      Query query(1);
+      if (command == "author") {
+        query[0].op = QUERY_EQUAL;
+        query[0].name = "author";
+        query[0].value = join_words(words, 2, words.size());
+      } else {
+        query.clear();
+        std::stringstream lines(payload);
+        std::string line;
+        while (std::getline(lines, line)) {
+          line = trim(line);
+          if (line.empty()) continue;
+          QueryTerm term;
+          if (!parse_query_term(line, term))
+            throw std::runtime_error("bad query term \"" + line + "\"\n");
+          query.push_back(term);
+        }
+      }
+      auto& file = refresh(words[1], false);
+      ReadLock lock(file.lock);
+      auto selected = file.query_index->select(query);
+      print_selected(reply, file.entries, selected, FORMAT_BIBTEX);
+    } else if (command == "reload" && words.size() == 2) {
+      refresh(words[1], true);
+    } else {
+      throw std::runtime_error("bad request \"" + command + "\"\n");
+    }
+    return reply.str();
+  }
+
+  /* a client gets this long between reads and this many bytes
+     per request, so a stalled or runaway one cannot hold a worker */
+  static constexpr int request_timeout_seconds = 10;
+  static constexpr size_t max_request_size = size_t(64) << 20;
+
+  /* reads until the client shuts down its end, returns the
+     reason for giving up early or an empty string */
+  static std::string read_request(int fd, std::string& s) {
+    char buf[4096];
+    while (true) {
+      auto n = ::read(fd, buf, sizeof(buf));
+      if (n == 0) return std::string();
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return "request timed out\n";
+        return std::string("could not read request: ") +
+          std::strerror(errno) + "\n";
+      }
+      if (s.size() + size_t(n) > max_request_size)
+        return "request is larger than " +
+          std::to_string(max_request_size) + " bytes\n";
+      s.append(buf, size_t(n));
+    }
+  }
+
+  void serve_connection(int fd) {
+    struct timeval timeout;
+    timeout.tv_sec = request_timeout_seconds;
+    timeout.tv_usec = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string request;
+    auto failure = read_request(fd, request);
+    std::string reply;
+    if (!failure.empty()) {
+      reply = "error\n" + failure;
+    } else {
+      try {
+        reply = "ok\n" + handle(request);
+      } catch (std::exception const& e) {
+        reply = std::string("error\n") + e.what();
+      }
+    }
+    write_all(fd, reply);
+    ::close(fd);
+  }
+
+  void work() {
+    while (true) {
+      int fd;
+      {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_cv.wait(lock, [this]() { return !queue.empty(); });
+        fd = queue.front();
+        queue.pop_front();
+      }
+      serve_connection(fd);
+    }
+  }
+
+public:
+
+  Server(FixOptions const& o):options(o) {}
+
+  int run(char const* socket_path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(socket_path) >= sizeof(addr.sun_path)) {
+      std::cout << "socket path " << socket_path << " is too long\n";
+      return -1;
+    }
+    std::strcpy(addr.sun_path, socket_path);
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+      std::cout << "could not create socket\n";
+      return -1;
+    }
+    /* only a socket left over from an earlier server is removed,
+       anything else at that path is not ours to delete */
+    struct stat st;
+    if (::lstat(socket_path, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+        std::cout << socket_path << " exists and is not a socket\n";
+        ::close(listener);
+        return -1;
+      }
+      ::unlink(socket_path);
+    }
+    if (::bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        ::listen(listener, SOMAXCONN) != 0) {
+      std::cout << "could not listen on " << socket_path << "\n";
+      return -1;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    get_abbrev_tables();
+    unsigned nworkers = std::max(2u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < nworkers; ++i)
+      workers.push_back(std::thread(&Server::work, this));
+    while (true) {
+      int fd = ::accept(listener, nullptr, nullptr);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        std::cout << "accept failed: " << std::strerror(errno) << "\n";
+        break;
+      }
+      {
+        std::lock_guard<std::mutex> guard(queue_mutex);
+        queue.push_back(fd);
+      }
+      queue_cv.notify_one();
+    }
+    ::close(listener);
+    ::unlink(socket_path);
+    for (auto& worker : workers) worker.detach();
+    return -1;
+  }
+};
+
+/* runs task(0) ... task(n - 1) on all cores */
+static void run_parallel(size_t n, std::function<void(size_t)> const& task) {
+  std::atomic<size_t> next(0);
+  auto work = [&]() {
+    for (size_t i; (i = next++) < n;) task(i);
+  };
+  size_t nthreads = std::max(1u, std::thread::hardware_concurrency());
+  nthreads = std::min(nthreads, n);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nthreads; ++i) threads.push_back(std::thread(work));
+  work();
+  for (auto& thread : threads) thread.join();
+}
+
+/* stable sort on all cores: chunks are sorted
+   in parallel, then merged pairwise in parallel */
+template <typename T, typename Less>
+static void parallel_sort(std::vector<T>& v, Less less) {
+  size_t nthreads = std::max(1u, std::thread::hardware_concurrency());
+  size_t chunk = std::max(size_t(1) << 12, (v.size() + nthreads - 1) / nthreads);
+  std::vector<size_t> bounds;
+  for (size_t i = 0; i < v.size(); i += chunk) bounds.push_back(i);
+  bounds.push_back(v.size());
+  run_parallel(bounds.size() - 1, [&](size_t i) {
+    std::stable_sort(v.begin() + bounds[i], v.begin() + bounds[i + 1], less);
+  });
+  while (bounds.size() > 2) {
+    run_parallel((bounds.size() - 1) / 2, [&](size_t i) {
+      std::inplace_merge(v.begin() + bounds[2 * i], v.begin() + bounds[2 * i + 1],
+          v.begin() + bounds[2 * i + 2], less);
+    });
+    std::vector<size_t> merged;
+    for (size_t i = 0; i < bounds.size(); i += 2) merged.push_back(bounds[i]);
+    if (merged.back() != v.size()) merged.push_back(v.size());
+    bounds.swap(merged);
+  }
+}
+
+/* fixrefs --sort key,year,... orders entries by the given
+   fields: key, type, year, author (last name of the first
+   author) or any other field name, compared case-insensitively
+   with missing values last, ties broken by key and input order.
+   @preamble and @string records come first, and comments
+   travel with the entry that follows them.
+
+   Entries are sorted in memory on all cores as long as they
+   fit in the --memory budget (MiB).
+   Past it, sorted runs are spilled to temporary files as
+   normalized BibTeX and merged back into the output.
+ */
+
+enum SortField {
+  SORT_KEY,
+  SORT_TYPE,
+  SORT_YEAR,
+  SORT_AUTHOR,
+  SORT_OTHER
+};
+
+struct SortKey {
+  SortField field;
+  std::string name;
+};
+
+using SortKeys = std::vector<SortKey>;
+
+static bool parse_sort_keys(std::string const& spec, SortKeys& keys) {
+  std::stringstream stream(spec);
+  std::string name;
+  keys.clear();
+  while (std::getline(stream, name, ',')) {
+    if (name.empty()) return false;
+    SortKey key;
+    key.name = as_lowercase(name);
+    if (key.name == "key") key.field = SORT_KEY;
+    else if (key.name == "type") key.field = SORT_TYPE;
+    else if (key.name == "year") key.field = SORT_YEAR;
+    else if (key.name == "author") key.field = SORT_AUTHOR;
+    else key.field = SORT_OTHER;
+    keys.push_back(key);
+  }
+  return !keys.empty();
+}
+
+/* from the interned ids when the entry has them, entries
+   read back from a spilled run only have the text */
+static std::string first_author_last_name(Entry const& entry,
+    std::string const& authors) {
+  std::string last;
+  if (!entry.authors.empty()) {
+    last = full_last_name(get_author_table().get(entry.authors[0]));
+  } else {
+    /* the first name fix_author_lists would have interned,
+       or the first text when it interned none */
+    auto names = split_authors(authors);
+    auto first = names[0];
+    for (auto const& name : names) {
+      if (name.empty() || name == "others" || is_comma_list(name)) continue;
+      first = name;
+      break;
+    }
+    last = full_last_name(parse_person(first));
+  }
+  std::string s;
+  for (auto c : last) if (c != '{' && c != '}') s.push_back(std::tolower(c));
+  return s;
+}
+
+/* the year, zero-padded so that it compares correctly as text */
+static std::string sortable_year(Field const& field) {
+  int year = 0;
+  field_number(field, year);
+  char digits[16];
+  std::snprintf(digits, sizeof(digits), "%08d", year);
+  return digits;
+}
+
+/* one string per entry, so that comparing entries
+   is a single string comparison */
+static std::string sort_key_of(Entry const& entry, SortKeys const& keys) {
+  std::string s;
+  for (auto const& key : keys) {
+    if (key.field == SORT_KEY) s += as_lowercase(entry.key);
+    else if (key.field == SORT_TYPE) s += entry.type;
+    else {
+      auto field_name = key.field == SORT_YEAR ? "year" :
+        key.field == SORT_AUTHOR ? "author" : key.name;
+      auto it = find_field(entry, field_name);
+      if (it == entry.fields.end()) s.push_back('\x7f');
+      else if (key.field == SORT_YEAR) s += sortable_year(*it);
+      else if (key.field == SORT_AUTHOR) s += first_author_last_name(entry, it->value);
+      else s += as_lowercase(it->value);
+    }
+    s.push_back('\x01');
+  }
+  s += as_lowercase(entry.key);
+  s.push_back('\x01');
+  s += entry.key;
+  return s;
+}
+
+static size_t estimate_bytes(Entry const& entry) {
+  size_t n = sizeof(Entry) + entry.type.size() + entry.key.size() + entry.comment.size() +
+    entry.authors.size() * sizeof(uint32_t);
+  for (auto const& field : entry.fields)
+    n += sizeof(Field) + field.name.size() + field.value.size();
+  return n;
+}
+
+struct SortItem {
+  std::string sort_key;
+  Entries comments;
+  Entry entry;
+};
+
+static bool sort_item_less(SortItem const& a, SortItem const& b) {
+  return a.sort_key < b.sort_key;
+}
+
+static void print_sort_item(std::ostream& stream, SortItem const& item) {
+  print_entries(stream, item.comments);
+  print_entry(stream, item.entry);
+}
+
+static void write_sort_item(EntryWriter& writer, SortItem const& item) {
+  for (auto const& comment : item.comments) writer.write(comment);
+  writer.write(item.entry);
+}
+
+/* warn_missing_fields for entries that arrive in batches:
+   fields that may come through a crossref are checked in
+   finish(), once every entry has gone through see() */
+class MissingFieldChecker {
+  struct Pending {
+    std::string key;
+    std::string crossref;
+    std::string field_name;
+  };
+  struct Target {
+    Target():seen(false) {}
+    bool seen;
+    StringSet field_names;
+  };
+  std::vector<Pending> pending;
+  std::unordered_map<std::string, Target> targets;
+
+public:
+
+  void check(std::ostream& log, Entries const& entries) {
+    for (auto const& entry : entries) {
+      for (auto const& field_name : get_required_fields(entry.type)) {
+        if (has_field(entry, field_name)) continue;
+        if (!has_field(entry, "crossref")) {
+          log << entry.key << " has no " << field_name << "\n";
+          continue;
+        }
+        Pending p;
+        p.key = entry.key;
+        p.crossref = get_field(entry, "crossref");
+        p.field_name = field_name;
+        targets[p.crossref];
+        pending.push_back(p);
+      }
+    }
+  }
+
+  void see(Entry const& entry) {
+    auto it = targets.find(entry.key);
+    if (it == targets.end() || it->second.seen) return;
+    it->second.seen = true;
+    for (auto const& field : entry.fields) it->second.field_names.insert(field.name);
+  }
+
+  void finish(std::ostream& log) {
+    for (auto const& p : pending) {
+      auto const& target = targets[p.crossref];
+      if (!target.seen)
+        log << "WARNING: " << p.key << " crossref " << p.crossref << " not found\n";
+      if (!target.field_names.count(p.field_name))
+        log << p.key << " has no " << p.field_name << "\n";
+    }
+  }
+};
+
+static std::string make_temp_file(int& fd) {
+  char const* dir = std::getenv("TMPDIR");
+  std::string path = std::string(dir ? dir : "/tmp") + "/fixrefs.XXXXXX";
+  std::vector<char> name(path.begin(), path.end());
+  name.push_back('\0');
+  fd = ::mkstemp(name.data());
+  return std::string(name.data());
+}
+
+/* reads back a run spilled by EntrySorter */
+class RunReader {
+  std::ifstream stream;
+  Parser parser;
+  Entries batch;
+  size_t next;
+  bool more;
+
+public:
+
+  RunReader(std::string const& path):stream(path),next(0),more(true) {
+    parser.start();
+  }
+
+  bool read(SortItem& item, SortKeys const& keys) {
+    item.comments.clear();
+    while (true) {
+      if (next == batch.size()) {
+        if (!more) return false;
+        more = parser.run_batch(stream, batch, 64);
+        next = 0;
+        continue;
+      }
+      auto& entry = batch[next++];
+      if (entry.type == "comment") {
+        item.comments.push_back(std::move(entry));
+      } else {
+        item.entry = std::move(entry);
+        item.sort_key = sort_key_of(item.entry, keys);
+        return true;
+      }
+    }
+  }
+};
+
+class EntrySorter {
+  SortKeys keys;
+  size_t budget;
+  Entries head;
+  Entries comments;
+  std::vector<SortItem> items;
+  size_t items_bytes;
+  StringVector runs;
+
+  void spill() {
+    parallel_sort(items, sort_item_less);
+    int fd;
+    auto path = make_temp_file(fd);
+    if (fd < 0) throw std::runtime_error("could not create a temporary file in " + path + "\n");
+    ::close(fd);
+    runs.push_back(path);
+    std::ofstream stream(path);
+    for (auto const& item : items) print_sort_item(stream, item);
+    if (!stream) throw std::runtime_error("could not write " + path + "\n");
+    std::vector<SortItem>().swap(items);
+    items_bytes = 0;
+  }
+
+  void merge_runs(EntryWriter& writer, MissingFieldChecker& checker) {
+    std::vector<std::unique_ptr<RunReader>> readers;
+    std::vector<SortItem> heads(runs.size());
+    using Head = std::pair<std::string const*, size_t>;
+    auto greater = [](Head const& a, Head const& b)->bool {
+      if (*a.first != *b.first) return *b.first < *a.first;
+      return b.second < a.second;
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(greater)> queue(greater);
+    for (size_t i = 0; i < runs.size(); ++i) {
+      readers.push_back(std::unique_ptr<RunReader>(new RunReader(runs[i])));
+      if (readers[i]->read(heads[i], keys)) queue.push(Head(&heads[i].sort_key, i));
+    }
+    while (!queue.empty()) {
+      auto i = queue.top().second;
+      queue.pop();
+      write_sort_item(writer, heads[i]);
+      checker.see(heads[i].entry);
+      if (readers[i]->read(heads[i], keys)) queue.push(Head(&heads[i].sort_key, i));
+    }
+  }
+
+public:
+
+  EntrySorter(SortKeys const& k, size_t b):keys(k),budget(b),items_bytes(0) {}
+
+  ~EntrySorter() {
+    for (auto const& run : runs) ::unlink(run.c_str());
+  }
+
+  void add(Entries& entries) {
+    for (auto& entry : entries) {
+      if (entry.type == "comment") {
+        comments.push_back(std::move(entry));
+      } else if (entry.type == "preamble" || entry.type == "string") {
+        head.insert(head.end(), comments.begin(), comments.end());
+        comments.clear();
+        head.push_back(std::move(entry));
+      } else {
+        SortItem item;
+        item.comments.swap(comments);
+        for (auto const& comment : item.comments) items_bytes += estimate_bytes(comment);
+        item.sort_key = sort_key_of(entry, keys);
+        items_bytes += estimate_bytes(entry) + item.sort_key.size() + sizeof(SortItem);
+        item.entry = std::move(entry);
+        items.push_back(std::move(item));
+        if (items_bytes > budget) spill();
+      }
+    }
+  }
+
+  /* the sorted entries, when nothing was spilled */
+  Entries take_sorted() {
+    assert(runs.empty());
+    parallel_sort(items, sort_item_less);
+    Entries entries;
+    entries.swap(head);
+    for (auto& item : items) {
+      for (auto& comment : item.comments) entries.push_back(std::move(comment));
+      entries.push_back(std::move(item.entry));
+    }
+    for (auto& comment : comments) entries.push_back(std::move(comment));
+    std::vector<SortItem>().swap(items);
+    comments.clear();
+    return entries;
+  }
+
+  void finish(EntryWriter& writer, MissingFieldChecker& checker) {
+    for (auto const& entry : head) {
+      writer.write(entry);
+      checker.see(entry);
+    }
+    if (runs.empty()) {
+      parallel_sort(items, sort_item_less);
+      for (auto const& item : items) {
+        write_sort_item(writer, item);
+        checker.see(item.entry);
+      }
+    } else {
+      if (!items.empty()) spill();
+      merge_runs(writer, checker);
+    }
+    for (auto const& comment : comments) writer.write(comment);
+    writer.finish();
+  }
+};
+
+static void sort_entries(Entries& entries, SortKeys const& keys) {
+  EntrySorter sorter(keys, SIZE_MAX);
+  sorter.add(entries);
+  entries = sorter.take_sorted();
+}
+
+/* a regular run with --sort, keeping at most about
+   budget bytes of entries in memory */
+static bool sort_file(std::string const& inpath, std::string const& outpath,
+    SortKeys const& keys, size_t budget, OutputFormat format, FixOptions const& options) {
+  EntrySorter sorter(keys, budget);
+  MissingFieldChecker checker;
+  try {
+    InputFile file;
+    if (!file.open(inpath)) {
+      std::cout << "could not open " << inpath << " for reading\n";
+      return false;
+    }
+    Parser parser(options.strings);
+    parser.start();
+    Entries batch;
+    while (parser.run_batch(file.get(), batch, 1024)) {
+      fix_entries(std::cout, batch, options);
+      checker.check(std::cout, batch);
+      sorter.add(batch);
+    }
+  } catch (std::exception const& e) {
+    std::cout << e.what();
+    return false;
+  }
+  OutputFile file;
+  if (!file.open(outpath)) return false;
+  try {
+    EntryWriter writer(file.get(), format);
+    sorter.finish(writer, checker);
+  } catch (std::exception const& e) {
+    std::cout << e.what();
+    return false;
+  }
+  checker.finish(std::cout);
+  return file.commit();
+}
+
+/* fixrefs --merge out.bib in.bib...
+   normalizes every input like a regular run and merges
+   them into one file sorted by key.
+   @preamble and @string records come first, and comments
+   travel with the entry that follows them.
+
+   Two entries are the same work if they have the same doi,
+   or the same key and no differing doi or title.
+   The --policy decides what survives:
+     keep     the first entry seen
+     replace  the last entry seen
+     combine  the first entry seen, plus the fields
+              it lacks from the later ones (default)
+   The survivor always keeps the first key seen, since
+   documents may already cite it.
+   Different works sharing a key get a letter suffix.
+ */
+
+enum MergePolicy {
+  MERGE_KEEP,
+  MERGE_REPLACE,
+  MERGE_COMBINE
+};
+
+static bool parse_merge_policy(std::string const& name, MergePolicy& policy) {
+  if (name == "keep") policy = MERGE_KEEP;
+  else if (name == "replace") policy = MERGE_REPLACE;
+  else if (name == "combine") policy = MERGE_COMBINE;
+  else return false;
+  return true;
+}
+
+struct MergeItem {
+  Entries comments;
+  Entry entry;
+};
+
+/* whether both entries have the field and its values differ */
+static bool differ_in(Entry const& a, Entry const& b, std::string const& field_name) {
+  auto ait = find_field(a, field_name);
+  auto bit = find_field(b, field_name);
+  if (ait == a.fields.end() || bit == b.fields.end()) return false;
+  if (field_name == "doi") return doi_of(a) != doi_of(b);
+  return as_lowercase(ait->value) != as_lowercase(bit->value);
+}
+
+/* BibTeX keys are case-insensitive */
+static bool key_less(std::string const& a, std::string const& b) {
+  auto lower_less = [](char x, char y)->bool {
+    return std::tolower(x) < std::tolower(y); };
+  if (std::lexicographical_compare(begin(a), end(a), begin(b), end(b), lower_less))
+    return true;
+  if (std::lexicographical_compare(begin(b), end(b), begin(a), end(a), lower_less))
+    return false;
+  return a < b;
+}
+
+class Merger {
+  MergePolicy policy;
+  Entries preambles;
+  Entries strings;
+  StringSet preamble_values;
+  KeyIndex string_index;
+  std::vector<MergeItem> items;
+  /* by lowercased key, BibTeX treats keys differing
+     only in case as the same entry */
+  KeyIndex key_index;
+  /* every key in any input, lowercased, which a
+     renamed entry must not take */
+  StringSet reserved;
+  KeyIndex doi_index;
+  Entries comments;
+
+  void resolve(std::ostream& log, MergeItem& item, Entry const& entry) {
+    auto& kept = item.entry;
+    if (entry.key != kept.key)
+      log << "WARNING: " << entry.key << " duplicates " << kept.key << "\n";
+    if (policy == MERGE_REPLACE) {
+      auto key = kept.key;
+      kept = entry;
+      kept.key = key;
+    } else if (policy == MERGE_COMBINE) {
+      for (auto const& field : entry.fields) {
+        if (has_field(kept, field.name)) continue;
+        kept.fields.push_back(field);
+        if (field.name == "author") kept.authors = entry.authors;
+      }
+    }
+    item.comments.insert(item.comments.end(), comments.begin(), comments.end());
+    comments.clear();
+  }
+
+  bool is_free(std::string const& key) {
+    auto lower = as_lowercase(key);
+    return !key_index.count(lower) && !reserved.count(lower);
+  }
+
+  std::string free_key(std::string const& key) {
+    for (char suffix = 'b'; suffix <= 'z'; ++suffix) {
+      auto candidate = key + suffix;
+      if (is_free(candidate)) return candidate;
+    }
+    for (size_t n = 2;; ++n) {
+      auto candidate = key + "_" + std::to_string(n);
+      if (is_free(candidate)) return candidate;
+    }
+  }
+
+  void add_entry(std::ostream& log, Entry const& entry) {
+    auto doi = doi_of(entry);
+    if (!doi.empty()) {
+      auto it = doi_index.find(doi);
+      if (it != doi_index.end()) {
+        resolve(log, items[it->second], entry);
+        return;
+      }
+    }
+    auto key = entry.key;
+    auto it = key_index.find(as_lowercase(key));
+    if (it != key_index.end()) {
+      auto& item = items[it->second];
+      if (!differ_in(item.entry, entry, "doi") &&
+          !differ_in(item.entry, entry, "title")) {
+        resolve(log, item, entry);
+        auto kept_doi = doi_of(item.entry);
+        if (!kept_doi.empty()) doi_index.insert(std::make_pair(kept_doi, it->second));
+        return;
+      }
+      key = free_key(key);
+      log << "WARNING: " << entry.key << " renamed to " << key
+        << ", a different entry has the same key\n";
+    }
+    MergeItem item;
+    item.comments.swap(comments);
+    item.entry = entry;
+    item.entry.key = key;
+    key_index[as_lowercase(key)] = items.size();
+    if (!doi.empty()) doi_index[doi] = items.size();
+    items.push_back(item);
+  }
+
+public:
+
+  Merger(MergePolicy p):policy(p) {}
+
+  /* called with every input before the first add, so that
+     a key some later input uses is never given away */
+  void reserve(Entries const& entries) {
+    for (auto const& entry : entries)
+      if (entry.type != "comment" && entry.type != "preamble" &&
+          entry.type != "string")
+        reserved.insert(as_lowercase(entry.key));
+  }
+
+  void add(std::ostream& log, Entries const& entries) {
+    for (auto const& entry : entries) {
+      if (entry.type == "comment") {
+        comments.push_back(entry);
+      } else if (entry.type == "preamble") {
+        preambles.insert(preambles.end(), comments.begin(), comments.end());
+        comments.clear();
+        if (preamble_values.insert(entry.fields.back().value).second)
+          preambles.push_back(entry);
+      } else if (entry.type == "string") {
+        strings.insert(strings.end(), comments.begin(), comments.end());
+        comments.clear();
+        auto const& name = entry.fields.back().name;
+        auto it = string_index.find(name);
+        if (it == string_index.end()) {
+          string_index[name] = strings.size();
+          strings.push_back(entry);
+        } else if (strings[it->second].fields.back().value !=
+                   entry.fields.back().value) {
+          log << "WARNING: @string " << name << " defined differently, keeping the first\n";
+        }
+      } else {
+        add_entry(log, entry);
+      }
+    }
+  }
+
+  Entries finish() {
+    std::sort(begin(items), end(items),
+        [](MergeItem const& a, MergeItem const& b)->bool {
+          return key_less(a.entry.key, b.entry.key); });
+    Entries entries;
+    entries.swap(preambles);
+    entries.insert(entries.end(), strings.begin(), strings.end());
+    for (auto& item : items) {
+      entries.insert(entries.end(), item.comments.begin(), item.comments.end());
+      entries.push_back(item.entry);
+    }
+    entries.insert(entries.end(), comments.begin(), comments.end());
+    return entries;
+  }
+};
+
+/* parses and normalizes the inputs on all cores,
+   then merges them in input order */
+static bool merge_files(StringVector const& paths, MergePolicy policy,
+    FixOptions const& options, Entries& merged) {
+  std::vector<Entries> parsed(paths.size());
+  StringVector logs(paths.size());
+  std::vector<char> failed(paths.size(), 0);
+  run_parallel(paths.size(), [&](size_t i) {
+    std::stringstream log;
+    InputFile file;
+    if (!file.open(paths[i])) {
+      log << "could not open " << paths[i] << " for reading\n";
+      failed[i] = 1;
+    } else {
+      try {
+        Parser parser(options.strings);
+        parser.run(file.get());
+        parsed[i].swap(parser.get_entries());
+        fix_entries(log, parsed[i], options);
+      } catch (ParseError const& e) {
+        log << paths[i] << ": " << e.what();
+        failed[i] = 1;
+      }
+    }
+    logs[i] = log.str();
+  });
+  bool ok = true;
+  Merger merger(policy);
+  for (auto const& entries : parsed) merger.reserve(entries);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::cout << logs[i];
+    if (failed[i]) ok = false;
+    merger.add(std::cout, parsed[i]);
+    Entries().swap(parsed[i]);
+  }
+  merged = merger.finish();
+  return ok;
+}
+
+static bool write_entries(std::string const& outpath, Entries const& entries,
+    OutputFormat format, Compression compression) {
+  OutputFile file;
+  if (!file.open(outpath, compression)) return false;
+  {
+    EntryWriter writer(file.get(), format);
+    for (auto const& entry : entries) writer.write(entry);
+    writer.finish();
+  }
+  return file.commit();
+}
+
+/* runs read, transform and write on their own threads,
+   joined by short queues of batches so that each waits when
+   it gets ahead and batches stay in order. read returns false
+   when it has nothing more; write runs on the calling thread. */
+static void run_pipeline(std::function<bool(Entries&)> const& read,
+    std::function<void(Entries&)> const& transform,
+    std::function<void(Entries&)> const& write) {
+  BoundedQueue<Entries> parsed(4);
+  BoundedQueue<Entries> fixed(4);
+  std::thread reader([&]() {
+    Entries batch;
+    while (read(batch))
+      if (!parsed.push(std::move(batch))) break;
+    parsed.close();
+  });
+  std::thread transformer([&]() {
+    Entries batch;
+    while (parsed.pop(batch)) {
+      transform(batch);
+      if (!fixed.push(std::move(batch))) break;
+    }
+    fixed.close();
+  });
+  Entries batch;
+  while (fixed.pop(batch)) write(batch);
+  reader.join();
+  transformer.join();
+}
+
+/* a regular run: parsing, the passes and writing
+   overlap, a batch of entries at a time */
+static bool convert_file(std::string const& inpath, std::string const& outpath,
+    OutputFormat format, FixOptions const& options) {
+  InputFile in;
+  if (!in.open(inpath)) {
+    std::cout << "could not open " << inpath << " for reading\n";
+    return false;
+  }
+  OutputFile out;
+  if (!out.open(outpath)) return false;
+  MissingFieldChecker checker;
+  Parser parser(options.strings);
+  parser.start();
+  std::string error;
+  Entries unparsed;
+  {
+    EntryWriter writer(out.get(), format);
+    run_pipeline(
+        [&](Entries& batch)->bool {
+          try {
+            return parser.run_batch(in.get(), batch, 1024);
+          } catch (ParseError const& e) {
+            error = e.what();
+            unparsed.swap(parser.get_entries());
+            return false;
+          }
+        },
+        [&](Entries& batch) {
+          fix_entries(std::cout, batch, options);
+          checker.check(std::cout, batch);
+          for (auto const& entry : batch) checker.see(entry);
+        },
+        [&](Entries& batch) {
+          for (auto const& entry : batch) writer.write(entry);
+        });
+    writer.finish();
+  }
+  if (!error.empty()) {
+    std::cout << error;
+    print_entries(std::cout, unparsed);
+    return false;
+  }
+  checker.finish(std::cout);
+  return out.commit();
+}
+
+/* normalization messages go to stderr, since
+   the selected entries may go to stdout */
+static bool run_query(StringVector const& paths, Query const& query,
+    OutputFormat format, FixOptions const& options) {
+  Parser parser(options.strings);
+  {
+    InputFile file;
+    if (!file.open(paths[0])) {
+      std::cout << "could not open " << paths[0] << " for reading\n";
+      return false;
+    }
+    try {
+      parser.run(file.get());
+    } catch (ParseError const& e) {
+      std::cout << e.what();
+      return false;
+    }
+  }
+  auto& entries = parser.get_entries();
+  fix_entries(std::cerr, entries, options);
+  QueryIndex index(entries);
+  auto selected = index.select(query);
+  if (paths.size() < 2) {
+    print_selected(std::cout, entries, selected, format);
+    return true;
+  }
+  OutputFile file;
+  if (!file.open(paths[1])) return false;
+  print_selected(file.get(), entries, selected, format);
+  return file.commit();
+}
+
+static int usage(char const* argv0) {
+  std::cout << "usage: " << argv0 << " input.bib output.bib\n";
+  std::cout << "       " << argv0 << " -i inout.bib\n";
+  std::cout << "       " << argv0 << " --serve socket\n";
+  std::cout << "       " << argv0 << " --merge [--policy keep|replace|combine] output.bib input.bib...\n";
+  std::cout << "       " << argv0 << " --query --where TERM... input.bib [output]\n";
+  std::cout << "       " << argv0 << " --build-doi-index crossref.jsonl doi.index\n";
+  std::cout << "options: --sort key|type|year|author|<field>[,...]  --memory MiB\n";
+  std::cout << "         --authors keep|last-first|first-last\n";
+  std::cout << "         --format bibtex|jsonl|csl-json  (--json for jsonl)\n";
+  std::cout << "         --doi-index doi.index\n";
+  std::cout << "         --strings keep|expand\n";
+  return -1;
+}
+
+int main(int argc, char** argv) {
+  bool inplace = false;
+  bool merge = false;
+  bool query_mode = false;
+  bool build_index = false;
+  DoiIndex doi_index;
+  OutputFormat format = FORMAT_BIBTEX;
+  Query query;
+  MergePolicy policy = MERGE_COMBINE;
+  FixOptions options;
+  SortKeys sort_keys;
+  size_t sort_budget = size_t(1) << 30;
+  const char* sockpath = nullptr;
+  StringVector paths;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "-i") inplace = true;
+    else if (arg == "--serve" && i + 1 < argc) sockpath = argv[++i];
+    else if (arg == "--merge") merge = true;
+    else if (arg == "--query") query_mode = true;
+    else if (arg == "--build-doi-index") build_index = true;
+    else if (arg == "--doi-index" && i + 1 < argc) {
+      if (!doi_index.open(argv[++i])) return -1;
+      options.doi_index = &doi_index;
+    }
+    else if (arg == "--json") format = FORMAT_JSON_LINES;
+    else if (arg == "--format" && i + 1 < argc) {
+      if (!parse_output_format(argv[++i], format)) return usage(argv[0]);
+    }
+    else if (arg == "--where" && i + 1 < argc) {
+      QueryTerm term;
+      if (!parse_query_term(argv[++i], term)) return usage(argv[0]);
+      query.push_back(term);
+    }
+    else if (arg == "--policy" && i + 1 < argc) {
+      if (!parse_merge_policy(argv[++i], policy)) return usage(argv[0]);
+    }
+    else if (arg == "--sort" && i + 1 < argc) {
+      if (!parse_sort_keys(argv[++i], sort_keys)) return usage(argv[0]);
+    }
+    else if (arg == "--strings" && i + 1 < argc) {
+      if (!parse_string_macros(argv[++i], options.strings)) return usage(argv[0]);
+    }
+    else if (arg == "--authors" && i + 1 < argc) {
+      if (!parse_author_style(argv[++i], options.author_style)) return usage(argv[0]);
+    }
+    else if (arg == "--memory" && i + 1 < argc) {
+      sort_budget = size_t(std::atol(argv[++i])) << 20;
+      if (!sort_budget) return usage(argv[0]);
+    }
+    else paths.push_back(arg);
+  }
+  /* JSON has no macros */
+  if (format != FORMAT_BIBTEX) options.strings = STRINGS_EXPAND;
+  options.format = format;
+  if (build_index) {
+    if (paths.size() != 2) return usage(argv[0]);
+    return build_doi_index(paths[0], paths[1]) ? 0 : -1;
+  }
+  if (sockpath) {
+    Server server(options);
+    return server.run(sockpath);
+  }
+  if (merge) {
+    if (paths.size() < 2) return usage(argv[0]);
+    Entries merged;
+    if (!merge_files(StringVector(paths.begin() + 1, paths.end()), policy, options, merged))
+      return -1;
+    if (!sort_keys.empty()) sort_entries(merged, sort_keys);
+    warn_missing_fields(std::cout, merged);
+    return write_entries(paths[0], merged, format, compression_of_path(paths[0])) ? 0 : -1;
+  }
+  if (query_mode) {
+    if (paths.empty()) return usage(argv[0]);
+    return run_query(paths, query, format, options) ? 0 : -1;
+  }
+  if (paths.empty() || (!inplace && paths.size() < 2)) return usage(argv[0]);
+  if (inplace && format != FORMAT_BIBTEX) return usage(argv[0]);
+  auto const& inpath = paths[0];
+  auto const& outpath = inplace ? paths[0] : paths[1];
+  if (!sort_keys.empty())
+    return sort_file(inpath, outpath, sort_keys, sort_budget, format, options) ? 0 : -1;
+  if (!inplace) return convert_file(inpath, outpath, format, options) ? 0 : -1;
+  Parser parser(options.strings);
+  Compression compression;
+  {
+    InputFile file;
+    if (!file.open(inpath)) {
+      std::cout << "could not open " << inpath << " for reading\n";
+      return -1;
+    }
+    compression = file.get_compression();
+    try {
+      parser.run(file.get());
+    } catch (ParseError const& e) {
+      std::cout << e.what();
+      print_entries(std::cout, parser.get_entries());
+      return -1;
+    }
+  }
+  auto& entries = parser.get_entries();
+  auto nparsed = entries.size();
+  fix_entries(std::cout, entries, options);
+  warn_missing_fields(std::cout, entries);
+  /* spans are offsets into the decompressed text,
+     and the gaps would keep dropped @string definitions */
+  if (compression == COMPRESSION_NONE && options.strings == STRINGS_KEEP &&
+      spans_line_up(entries, nparsed)) {
+    return rewrite_in_place(inpath.c_str(), entries) ? 0 : -1;
+  }
+  return write_entries(outpath, entries, FORMAT_BIBTEX, compression) ? 0 : -1;
+}